@@ -0,0 +1,1600 @@
+// sigaction(), clock_gettime() and SIGWINCH are hidden behind this when
+// compiling with a strict -std.
+#define _DEFAULT_SOURCE
+
+#include "tui.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+/*** Append Buffer ***/
+char *abReserve(struct abuf *ab, int n) {
+  if (ab->len + n > ab->cap) {
+    int new_cap = ab->cap == 0 ? 256 : ab->cap * 2;
+    while (new_cap < ab->len + n) {
+      new_cap *= 2;
+    }
+    char *new = realloc(ab->buf, new_cap);
+    if (new == NULL) {
+      return NULL;
+    }
+    ab->buf = new;
+    ab->cap = new_cap;
+  }
+  return &ab->buf[ab->len];
+}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+  char *dst = abReserve(ab, len);
+
+  if (dst == NULL) {
+    return;
+  }
+  memcpy(dst, s, len);
+  ab->len += len;
+}
+
+void abAppendInt(struct abuf *ab, unsigned int n) {
+  // 10 digits is enough for any 32 bit unsigned int.
+  char *dst = abReserve(ab, 10);
+  char digits[10];
+  int len = 0;
+
+  if (dst == NULL) {
+    return;
+  }
+  do {
+    digits[len++] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  for (int i = 0; i < len; i++) {
+    dst[i] = digits[len - 1 - i];
+  }
+  ab->len += len;
+}
+
+void abAppendCsi(struct abuf *ab, int a, int b, char final) {
+  abAppend(ab, "\x1b[", 2);
+  if (a >= 0) {
+    abAppendInt(ab, a);
+    if (b >= 0) {
+      abAppend(ab, ";", 1);
+      abAppendInt(ab, b);
+    }
+  }
+  abAppend(ab, &final, 1);
+}
+
+void abReset(struct abuf *ab) { ab->len = 0; }
+
+void abFree(struct abuf *ab) {
+  free(ab->buf);
+  ab->buf = NULL;
+  ab->len = 0;
+  ab->cap = 0;
+}
+
+/*** Renderer State ***/
+
+// More scrolls than this between two presents and we just repaint.
+#define MAX_PENDING_SCROLLS 8
+
+static struct {
+  // current is what we believe the terminal is showing right now, next is what
+  // the caller wants it to show after the next present.
+  Buffer current;
+  Buffer next;
+  tui_color clear_fg;
+  tui_color clear_bg;
+  int cursor_x;
+  int cursor_y;
+  // Set when current can't be trusted (startup, resize, invalidate).
+  int full_redraw;
+  // Scrolls already applied to the grids that the terminal hasn't seen yet.
+  struct {
+    int top, bottom, n;
+    Cell blank;
+  } scrolls[MAX_PENDING_SCROLLS];
+  int num_scrolls;
+  // Frame output, reset rather than freed so it only grows to the largest
+  // frame we've produced and then stays allocated. out.buf[sent..out.len] is
+  // what the terminal hasn't taken yet.
+  struct abuf out;
+  int sent;
+  // A present came in while the last frame was still queued.
+  int deferred;
+  // Frames go out between TUI_SYNC_BEGIN and TUI_SYNC_END.
+  int sync;
+  tui_stats stats;
+  // Input time piling up until the next present hands it to stats.
+  long long read_ns;
+} T = {.clear_fg = TUI_DEFAULT, .clear_bg = TUI_DEFAULT, .cursor_x = -1};
+
+static long long nowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static Cell blankCell(void) {
+  return (Cell){.c = ' ', .fg = T.clear_fg, .bg = T.clear_bg};
+}
+
+static void fillBuffer(Buffer *b, Cell cell) {
+  int n = b->w * b->h;
+  for (int i = 0; i < n; i++) {
+    b->cells[i] = cell;
+  }
+}
+
+static int allocBuffer(Buffer *b, int w, int h) {
+  if (w * h > b->cap) {
+    Cell *cells = realloc(b->cells, sizeof(Cell) * w * h);
+    if (cells == NULL) {
+      return -1;
+    }
+    b->cells = cells;
+    b->cap = w * h;
+  }
+  b->w = w;
+  b->h = h;
+  return 0;
+}
+
+int tui_init(int rows, int cols) { return tui_resize(rows, cols); }
+
+void tui_shutdown(void) {
+  free(T.current.cells);
+  free(T.next.cells);
+  T.current = (Buffer){0};
+  T.next = (Buffer){0};
+  abFree(&T.out);
+  T.sent = 0;
+  T.deferred = 0;
+}
+
+int tui_resize(int rows, int cols) {
+  if (rows < 0 || cols < 0) {
+    return -1;
+  }
+  if (allocBuffer(&T.current, cols, rows) == -1 ||
+      allocBuffer(&T.next, cols, rows) == -1) {
+    return -1;
+  }
+  fillBuffer(&T.next, blankCell());
+  tui_invalidate();
+  return 0;
+}
+
+int tui_width(void) { return T.next.w; }
+
+int tui_height(void) { return T.next.h; }
+
+void tui_set_clear_attrs(tui_color fg, tui_color bg) {
+  T.clear_fg = fg;
+  T.clear_bg = bg;
+}
+
+void tui_clear(void) { fillBuffer(&T.next, blankCell()); }
+
+void tui_set_sync(int enabled) { T.sync = enabled; }
+
+void tui_set_cursor(int x, int y) {
+  T.cursor_x = x;
+  T.cursor_y = y;
+}
+
+void tui_invalidate(void) {
+  T.full_redraw = 1;
+  T.num_scrolls = 0;
+}
+
+// Shifts rows top..bottom of b by n, filling what scrolls in with blank.
+static void shiftRows(Buffer *b, int top, int bottom, int n, Cell blank) {
+  int w = b->w;
+  int height = bottom - top + 1;
+  int keep = height - (n > 0 ? n : -n);
+  Cell *region = &b->cells[top * w];
+
+  if (n > 0) {
+    memmove(region, &region[n * w], sizeof(Cell) * keep * w);
+    for (int i = keep * w; i < height * w; i++) {
+      region[i] = blank;
+    }
+  } else {
+    memmove(&region[-n * w], region, sizeof(Cell) * keep * w);
+    for (int i = 0; i < -n * w; i++) {
+      region[i] = blank;
+    }
+  }
+}
+
+int tui_scroll(int top, int bottom, int n) {
+  if (top < 0) {
+    top = 0;
+  }
+  if (bottom >= T.next.h) {
+    bottom = T.next.h - 1;
+  }
+  int height = bottom - top + 1;
+  if (n == 0 || height <= 0 || T.full_redraw) {
+    return 0;
+  }
+  if (n >= height || -n >= height || T.num_scrolls == MAX_PENDING_SCROLLS) {
+    // Nothing survives the scroll (or we lost track), repaint instead.
+    tui_invalidate();
+    return 0;
+  }
+
+  Cell blank = blankCell();
+  shiftRows(&T.current, top, bottom, n, blank);
+  shiftRows(&T.next, top, bottom, n, blank);
+  T.scrolls[T.num_scrolls].top = top;
+  T.scrolls[T.num_scrolls].bottom = bottom;
+  T.scrolls[T.num_scrolls].n = n;
+  T.scrolls[T.num_scrolls].blank = blank;
+  T.num_scrolls++;
+  return 1;
+}
+
+/*** Character Widths ***/
+
+// Sorted, non overlapping codepoint ranges. Not the complete Unicode tables,
+// but the blocks that actually show up in text: combining marks and friends
+// for zero width, CJK, Hangul, fullwidth forms and emoji for double width.
+static const uint32_t zero_width[][2] = {
+    {0x0300, 0x036F},   {0x0483, 0x0489},   {0x0591, 0x05BD},
+    {0x05BF, 0x05BF},   {0x05C1, 0x05C2},   {0x05C4, 0x05C5},
+    {0x05C7, 0x05C7},   {0x0610, 0x061A},   {0x064B, 0x065F},
+    {0x0670, 0x0670},   {0x06D6, 0x06DC},   {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8},   {0x06EA, 0x06ED},   {0x0900, 0x0902},
+    {0x093A, 0x093A},   {0x093C, 0x093C},   {0x0941, 0x0948},
+    {0x094D, 0x094D},   {0x0951, 0x0957},   {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A},   {0x0E47, 0x0E4E},   {0x1AB0, 0x1AFF},
+    {0x1DC0, 0x1DFF},   {0x200B, 0x200F},   {0x202A, 0x202E},
+    {0x2060, 0x2064},   {0x20D0, 0x20FF},   {0xFE00, 0xFE0F},
+    {0xFE20, 0xFE2F},   {0xFEFF, 0xFEFF},   {0xE0001, 0xE007F},
+    {0xE0100, 0xE01EF},
+};
+
+#if TUI_UTF8
+static const uint32_t double_width[][2] = {
+    {0x1100, 0x115F},   {0x231A, 0x231B},   {0x2329, 0x232A},
+    {0x23E9, 0x23EC},   {0x23F0, 0x23F0},   {0x23F3, 0x23F3},
+    {0x25FD, 0x25FE},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267F, 0x267F},   {0x2693, 0x2693},   {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB},   {0x26BD, 0x26BE},   {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE},   {0x26D4, 0x26D4},   {0x26EA, 0x26EA},
+    {0x26F2, 0x26F3},   {0x26F5, 0x26F5},   {0x26FA, 0x26FA},
+    {0x26FD, 0x26FD},   {0x2705, 0x2705},   {0x270A, 0x270B},
+    {0x2728, 0x2728},   {0x274C, 0x274C},   {0x274E, 0x274E},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27B0, 0x27B0},   {0x27BF, 0x27BF},   {0x2B1B, 0x2B1C},
+    {0x2B50, 0x2B50},   {0x2B55, 0x2B55},   {0x2E80, 0x303E},
+    {0x3041, 0x33FF},   {0x3400, 0x4DBF},   {0x4E00, 0x9FFF},
+    {0xA000, 0xA4CF},   {0xA960, 0xA97F},   {0xAC00, 0xD7A3},
+    {0xF900, 0xFAFF},   {0xFE10, 0xFE19},   {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60},   {0xFFE0, 0xFFE6},   {0x16FE0, 0x16FE4},
+    {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004},
+    {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A},
+    {0x1F200, 0x1F202}, {0x1F210, 0x1F23B}, {0x1F240, 0x1F248},
+    {0x1F250, 0x1F251}, {0x1F260, 0x1F265}, {0x1F300, 0x1F64F},
+    {0x1F680, 0x1F6FF}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F9FF},
+    {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+#endif
+
+static int inRanges(uint32_t c, const uint32_t (*r)[2], int n) {
+  int lo = 0;
+  int hi = n - 1;
+  if (c < r[0][0] || c > r[hi][1]) {
+    return 0;
+  }
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (c > r[mid][1]) {
+      lo = mid + 1;
+    } else if (c < r[mid][0]) {
+      hi = mid - 1;
+    } else {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int tui_char_width(uint32_t c) {
+  // Latin, and the control characters that get drawn as '?'.
+  if (c < 0x300) {
+    return 1;
+  }
+  if (inRanges(c, zero_width, sizeof(zero_width) / sizeof(zero_width[0]))) {
+    return 0;
+  }
+#if TUI_UTF8
+  if (inRanges(c, double_width,
+               sizeof(double_width) / sizeof(double_width[0]))) {
+    return 2;
+  }
+#endif
+  return 1;
+}
+
+/*** Drawing Primitives ***/
+
+// Makes room for a character at row[x]: if that cell is half of a double
+// width character, the other half is blanked so no half glyph is left.
+static void splitWide(Cell *row, int x, int w) {
+  if (row[x].c == TUI_CELL_CONT && x > 0) {
+    row[x - 1].c = ' ';
+  } else if (x + 1 < w && row[x + 1].c == TUI_CELL_CONT) {
+    row[x + 1].c = ' ';
+  }
+}
+
+// Puts c at (x, y), returns how many cells it took.
+static int drawGlyph(int x, int y, uint32_t c, tui_color fg, tui_color bg) {
+  if (x < 0 || y < 0 || x >= T.next.w || y >= T.next.h) {
+    return 0;
+  }
+  // Control characters would move the real cursor behind our back and the
+  // grid would no longer match the screen. Show them as '?' instead.
+  if (c < 0x20 || c == 0x7f) {
+    c = '?';
+  }
+  int width = tui_char_width(c);
+  if (width == 0) {
+    // Combining marks would need a grapheme per cell, leave them out.
+    return 0;
+  }
+
+  int w = T.next.w;
+  Cell *row = &T.next.cells[y * w];
+  if (width == 2 && x + 1 >= w) {
+    // Half of it would hang off the edge, the terminal would wrap it.
+    c = ' ';
+    width = 1;
+  }
+  splitWide(row, x, w);
+  row[x] = (Cell){.c = c, .fg = fg, .bg = bg};
+  if (width == 2) {
+    splitWide(row, x + 1, w);
+    row[x + 1] = (Cell){.c = TUI_CELL_CONT, .fg = fg, .bg = bg};
+  }
+  return width;
+}
+
+void tui_draw_char(int x, int y, uint32_t c, tui_color fg, tui_color bg) {
+  drawGlyph(x, y, c, fg, bg);
+}
+
+/**
+ * utf8Decode: Decodes one codepoint from s, storing it in *cp.
+ * Returns the number of bytes consumed (always >= 1). Malformed input decodes
+ * to U+FFFD one byte at a time so we can resync on the next lead byte.
+ */
+static int utf8Decode(const unsigned char *s, int len, uint32_t *cp) {
+  unsigned char b = s[0];
+  int need;
+  uint32_t c;
+
+  if (b < 0x80) {
+    *cp = b;
+    return 1;
+  } else if ((b & 0xE0) == 0xC0) {
+    need = 1;
+    c = b & 0x1F;
+  } else if ((b & 0xF0) == 0xE0) {
+    need = 2;
+    c = b & 0x0F;
+  } else if ((b & 0xF8) == 0xF0) {
+    need = 3;
+    c = b & 0x07;
+  } else {
+    *cp = 0xFFFD;
+    return 1;
+  }
+
+  if (need >= len) {
+    *cp = 0xFFFD;
+    return 1;
+  }
+  for (int i = 1; i <= need; i++) {
+    if ((s[i] & 0xC0) != 0x80) {
+      *cp = 0xFFFD;
+      return 1;
+    }
+    c = (c << 6) | (s[i] & 0x3F);
+  }
+  *cp = c;
+  return need + 1;
+}
+
+int tui_draw_str(int x, int y, const char *s, int len, tui_color fg,
+                 tui_color bg) {
+  const unsigned char *p = (const unsigned char *)s;
+  int i = 0;
+  int cells = 0;
+
+  int w = T.next.w;
+  int on_grid = x >= 0 && y >= 0 && y < T.next.h;
+
+  while (i < len && x + cells < w) {
+    if (on_grid && p[i] >= 0x20 && p[i] < 0x7f) {
+      // A run of printable ASCII goes straight into the cells. Only its two
+      // ends can cut a double width character in half.
+      Cell *row = &T.next.cells[y * w];
+      int start = x + cells;
+      int end = start;
+      splitWide(row, start, w);
+      while (i < len && end < w && p[i] >= 0x20 && p[i] < 0x7f) {
+        row[end++] = (Cell){.c = p[i++], .fg = fg, .bg = bg};
+      }
+      if (end < w && row[end].c == TUI_CELL_CONT) {
+        row[end].c = ' ';
+      }
+      cells += end - start;
+      continue;
+    }
+    uint32_t cp = p[i];
+    if (cp < 0x80) {
+      i++;
+    } else {
+      i += utf8Decode(p + i, len - i, &cp);
+    }
+    cells += drawGlyph(x + cells, y, cp, fg, bg);
+  }
+  return cells;
+}
+
+int tui_utf8_decode(const char *s, int len, uint32_t *cp) {
+  return utf8Decode((const unsigned char *)s, len, cp);
+}
+
+int tui_utf8_encode(uint32_t c, char *out) {
+  if (c < 0x80) {
+    out[0] = c;
+    return 1;
+  } else if (c < 0x800) {
+    out[0] = 0xC0 | (c >> 6);
+    out[1] = 0x80 | (c & 0x3F);
+    return 2;
+  } else if (c < 0x10000) {
+    out[0] = 0xE0 | (c >> 12);
+    out[1] = 0x80 | ((c >> 6) & 0x3F);
+    out[2] = 0x80 | (c & 0x3F);
+    return 3;
+  }
+  out[0] = 0xF0 | (c >> 18);
+  out[1] = 0x80 | ((c >> 12) & 0x3F);
+  out[2] = 0x80 | ((c >> 6) & 0x3F);
+  out[3] = 0x80 | (c & 0x3F);
+  return 4;
+}
+
+void tui_draw_rect(int x, int y, int w, int h, tui_color bg) {
+  for (int row = y; row < y + h; row++) {
+    for (int col = x; col < x + w; col++) {
+      tui_draw_char(col, row, ' ', T.clear_fg, bg);
+    }
+  }
+}
+
+/*** Present ***/
+#if TUI_RENDERER == TUI_RENDER_CELLS
+static int cellEqual(const Cell *a, const Cell *b) {
+  return a->c == b->c && a->fg == b->fg && a->bg == b->bg;
+}
+#endif
+
+#if TUI_RENDERER != TUI_RENDER_FULL && TUI_RENDERER != TUI_RENDER_ROWS &&      \
+    TUI_RENDERER != TUI_RENDER_CELLS
+#error "TUI_RENDERER must be one of the TUI_RENDER_* backends"
+#endif
+#if TUI_COLOR_DEPTH != 16 && TUI_COLOR_DEPTH != 256 && TUI_COLOR_DEPTH != 24
+#error "TUI_COLOR_DEPTH must be 16, 256 or 24"
+#endif
+
+static void appendGlyph(struct abuf *ab, uint32_t c) {
+#if TUI_UTF8
+  char buf[4];
+  abAppend(ab, buf, tui_utf8_encode(c, buf));
+#else
+  char b = c < 0x80 ? c : '?';
+  abAppend(ab, &b, 1);
+#endif
+}
+
+#if TUI_COLOR_DEPTH == 256
+static int colorDistance(int r, int g, int b, int r2, int g2, int b2) {
+  return (r - r2) * (r - r2) + (g - g2) * (g - g2) + (b - b2) * (b - b2);
+}
+
+// Index of the 6x6x6 cube level nearest to v, the levels being 0 and then
+// 95 to 255 in steps of 40.
+static int cubeLevel(int v) { return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40; }
+
+/**
+ * paletteIndex: The xterm palette entry nearest to color, from the color cube
+ * (16..231) or the gray ramp (232..255). The 16 system colors are left out,
+ * every terminal has its own idea of what they look like.
+ */
+static int paletteIndex(tui_color color) {
+  int r = (color >> 16) & 0xFF;
+  int g = (color >> 8) & 0xFF;
+  int b = color & 0xFF;
+  int cr = cubeLevel(r);
+  int cg = cubeLevel(g);
+  int cb = cubeLevel(b);
+  int lr = cr ? 55 + cr * 40 : 0;
+  int lg = cg ? 55 + cg * 40 : 0;
+  int lb = cb ? 55 + cb * 40 : 0;
+  int gray = (r + g + b) / 3;
+  int step = gray < 8 ? 0 : gray > 238 ? 23 : (gray - 8) / 10;
+  int lgray = 8 + step * 10;
+  if (colorDistance(r, g, b, lgray, lgray, lgray) <
+      colorDistance(r, g, b, lr, lg, lb)) {
+    return 232 + step;
+  }
+  return 16 + 36 * cr + 6 * cg + cb;
+}
+#elif TUI_COLOR_DEPTH == 16
+// The xterm defaults for the 8 normal and 8 bright colors.
+static const uint8_t system_colors[16][3] = {
+    {0, 0, 0},       {205, 0, 0},   {0, 205, 0},   {205, 205, 0},
+    {0, 0, 238},     {205, 0, 205}, {0, 205, 205}, {229, 229, 229},
+    {127, 127, 127}, {255, 0, 0},   {0, 255, 0},   {255, 255, 0},
+    {92, 92, 255},   {255, 0, 255}, {0, 255, 255}, {255, 255, 255},
+};
+
+static int paletteIndex(tui_color color) {
+  int r = (color >> 16) & 0xFF;
+  int g = (color >> 8) & 0xFF;
+  int b = color & 0xFF;
+  int best = 0;
+  int best_dist = INT32_MAX;
+  for (int i = 0; i < 16; i++) {
+    int dr = r - system_colors[i][0];
+    int dg = g - system_colors[i][1];
+    int db = b - system_colors[i][2];
+    int dist = dr * dr + dg * dg + db * db;
+    if (dist < best_dist) {
+      best = i;
+      best_dist = dist;
+    }
+  }
+  return best;
+}
+#else
+// Where each of the cube's six levels sits, by channel value.
+static int cubeStep(int v) {
+  switch (v) {
+  case 0:
+    return 0;
+  case 95:
+    return 1;
+  case 135:
+    return 2;
+  case 175:
+    return 3;
+  case 215:
+    return 4;
+  case 255:
+    return 5;
+  }
+  return -1;
+}
+
+/**
+ * exactPaletteIndex: The xterm palette entry (16..255) that is exactly color,
+ * or -1. "5;N" is up to 8 bytes shorter than "2;R;G;B" for the same color.
+ */
+static int exactPaletteIndex(tui_color color) {
+  int r = (color >> 16) & 0xFF;
+  int g = (color >> 8) & 0xFF;
+  int b = color & 0xFF;
+  int cr = cubeStep(r);
+  int cg = cubeStep(g);
+  int cb = cubeStep(b);
+  if (cr >= 0 && cg >= 0 && cb >= 0) {
+    return 16 + 36 * cr + 6 * cg + cb;
+  }
+  if (r == g && g == b && r >= 8 && r <= 238 && (r - 8) % 10 == 0) {
+    return 232 + (r - 8) / 10;
+  }
+  return -1;
+}
+#endif
+
+// Whether a and b come out as the same SGR color at TUI_COLOR_DEPTH.
+static int sameColor(tui_color a, tui_color b) {
+  if (a == b) {
+    return 1;
+  }
+#if TUI_COLOR_DEPTH < 24
+  return a != TUI_DEFAULT && b != TUI_DEFAULT &&
+         paletteIndex(a) == paletteIndex(b);
+#else
+  return 0;
+#endif
+}
+
+static void appendColor(struct abuf *ab, int base, tui_color color) {
+  // base is 30 for foreground, 40 for background.
+  if (color == TUI_DEFAULT) {
+    abAppendInt(ab, base + 9);
+    return;
+  }
+#if TUI_COLOR_DEPTH == 16
+  // The bright half is 90..97 / 100..107.
+  int i = paletteIndex(color);
+  abAppendInt(ab, i < 8 ? base + i : base + 60 + i - 8);
+#elif TUI_COLOR_DEPTH == 256
+  abAppendInt(ab, base + 8);
+  abAppend(ab, ";5;", 3);
+  abAppendInt(ab, paletteIndex(color));
+#else
+  abAppendInt(ab, base + 8);
+  int i = exactPaletteIndex(color);
+  if (i >= 0) {
+    abAppend(ab, ";5;", 3);
+    abAppendInt(ab, i);
+    return;
+  }
+  abAppend(ab, ";2;", 3);
+  abAppendInt(ab, (color >> 16) & 0xFF);
+  abAppend(ab, ";", 1);
+  abAppendInt(ab, (color >> 8) & 0xFF);
+  abAppend(ab, ";", 1);
+  abAppendInt(ab, color & 0xFF);
+#endif
+}
+
+// The terminal's colors as far as the frame being encoded knows. A frame
+// starts out not knowing, whoever wrote last may have left them anywhere.
+typedef struct Pen {
+  int known;
+  tui_color fg;
+  tui_color bg;
+} Pen;
+
+/**
+ * setPen: Brings the terminal's colors to fg/bg with the shortest SGR that
+ * does it: only the half that changed, or SGR 0 when both go back to the
+ * defaults. Sends nothing if they are there already.
+ */
+static void setPen(struct abuf *ab, Pen *pen, tui_color fg, tui_color bg) {
+  int set_fg = !pen->known || !sameColor(pen->fg, fg);
+  int set_bg = !pen->known || !sameColor(pen->bg, bg);
+  pen->known = 1;
+  pen->fg = fg;
+  pen->bg = bg;
+  if (!set_fg && !set_bg) {
+    return;
+  }
+  if (fg == TUI_DEFAULT && bg == TUI_DEFAULT) {
+    abAppend(ab, "\x1b[m", 3);
+    return;
+  }
+  abAppend(ab, "\x1b[", 2);
+  if (set_fg) {
+    appendColor(ab, 30, fg);
+  }
+  if (set_fg && set_bg) {
+    abAppend(ab, ";", 1);
+  }
+  if (set_bg) {
+    appendColor(ab, 40, bg);
+  }
+  abAppend(ab, "m", 1);
+}
+
+static void appendMove(struct abuf *ab, int x, int y, int cur_x, int cur_y) {
+  if (y == cur_y && cur_x >= 0) {
+    // Same row, only the column changes: CHA is shorter than CUP.
+    abAppendCsi(ab, x + 1, -1, 'G');
+  } else {
+    abAppendCsi(ab, y + 1, x + 1, 'H');
+  }
+}
+
+/**
+ * blankTail: Returns the index from which every cell of row to the end is the
+ * same blank, i.e. the part of the row an EL could paint in one go.
+ */
+static int blankTail(const Cell *row, int w) {
+  int x = w;
+  while (x > 0 && row[x - 1].c == ' ' && row[x - 1].fg == row[w - 1].fg &&
+         row[x - 1].bg == row[w - 1].bg) {
+    x--;
+  }
+  return x;
+}
+
+int tui_flush(void) {
+  int total = 0;
+  while (T.sent < T.out.len) {
+    ssize_t n = write(STDOUT_FILENO, T.out.buf + T.sent, T.out.len - T.sent);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+    T.sent += n;
+    total += n;
+  }
+  if (T.sent == T.out.len) {
+    abReset(&T.out);
+    T.sent = 0;
+  }
+  return total;
+}
+
+int tui_present(void) {
+  struct abuf *ab = &T.out;
+  if (T.sent < ab->len) {
+    // The last frame is still going out. Rather than queueing this one behind
+    // it, wait and encode whatever Next holds by then, every frame in between
+    // is dropped for free.
+    T.deferred = 1;
+    return 0;
+  }
+  T.deferred = 0;
+
+  int w = T.next.w;
+  int h = T.next.h;
+  // Where the terminal's cursor is, -1 when unknown.
+  int cur_x = -1;
+  int cur_y = -1;
+  Pen pen = {0};
+  int rows = 0;
+  long long start = nowNs();
+
+  abReset(ab);
+  // Whether anything but the cursor changes is only known at the end, the
+  // begin marker is taken back out then if not.
+  int painted = T.full_redraw || T.num_scrolls > 0;
+  if (T.sync) {
+    abAppend(ab, TUI_SYNC_BEGIN, strlen(TUI_SYNC_BEGIN));
+  }
+  abAppend(ab, "\x1b[?25l", 6);
+
+  if (T.full_redraw) {
+    Cell blank = blankCell();
+    setPen(ab, &pen, blank.fg, blank.bg);
+    abAppend(ab, "\x1b[2J", 4);
+    fillBuffer(&T.current, blank);
+    T.full_redraw = 0;
+  }
+
+  for (int i = 0; i < T.num_scrolls; i++) {
+    // The terminal fills the lines it scrolls in with the current
+    // background, make that the blank current already has there.
+    Cell blank = T.scrolls[i].blank;
+    setPen(ab, &pen, blank.fg, blank.bg);
+    int n = T.scrolls[i].n;
+    abAppendCsi(ab, T.scrolls[i].top + 1, T.scrolls[i].bottom + 1, 'r');
+    abAppendCsi(ab, n > 0 ? n : -n, -1, n > 0 ? 'S' : 'T');
+    // Back to the full screen. DECSTBM homes the cursor, so it's unknown now.
+    abAppend(ab, "\x1b[r", 3);
+  }
+  T.num_scrolls = 0;
+
+  for (int y = 0; y < h; y++) {
+    Cell *cur = &T.current.cells[y * w];
+    Cell *nxt = &T.next.cells[y * w];
+    int tail = -1;
+
+#if TUI_RENDERER == TUI_RENDER_ROWS
+    if (memcmp(cur, nxt, sizeof(Cell) * w) == 0) {
+      continue;
+    }
+#endif
+    // The row and full renderers send every cell from the left edge on, the
+    // cell renderer skips to the ones that differ.
+    for (int x = 0; x < w; x++) {
+#if TUI_RENDERER == TUI_RENDER_CELLS
+      if (cellEqual(&cur[x], &nxt[x])) {
+        continue;
+      }
+      if (nxt[x].c == TUI_CELL_CONT && x > 0) {
+        // Only the right half differs, the terminal needs the whole
+        // character again.
+        x--;
+      }
+#endif
+      if (tail == -1) {
+        tail = blankTail(nxt, w);
+        rows++;
+      }
+
+      if (x != cur_x || y != cur_y) {
+        appendMove(ab, x, y, cur_x, cur_y);
+        cur_x = x;
+        cur_y = y;
+      }
+      // A space only shows its background, and so does the EL below. On the
+      // pen's background whatever foreground it has is as good as the
+      // cell's, so the blanks between differently colored words don't switch
+      // it back and forth. Where the background changes anyway, the cell's
+      // foreground goes in the same SGR, it's likely the next word's.
+      tui_color fg = nxt[x].fg;
+      if (nxt[x].c == ' ' && pen.known && nxt[x].bg == pen.bg) {
+        fg = pen.fg;
+      }
+      if (!pen.known || fg != pen.fg || nxt[x].bg != pen.bg) {
+        setPen(ab, &pen, fg, nxt[x].bg);
+      }
+
+      if (x >= tail) {
+        // Everything from here on is the same blank, erase it instead of
+        // spelling it out. EL fills with the current background.
+        abAppend(ab, "\x1b[K", 3);
+        memcpy(&cur[x], &nxt[x], sizeof(Cell) * (w - x));
+        break;
+      }
+
+      appendGlyph(ab, nxt[x].c);
+      cur[x] = nxt[x];
+      cur_x++;
+      if (x + 1 < w && nxt[x + 1].c == TUI_CELL_CONT) {
+        // The terminal filled the right half with the same write.
+        cur[x + 1] = nxt[x + 1];
+        cur_x++;
+        x++;
+      }
+      if (cur_x >= w) {
+        // Writing the last column leaves the cursor in the pending-wrap
+        // state, where it is depends on the terminal. Force a real move.
+        cur_x = -1;
+      }
+    }
+  }
+
+  if (T.cursor_x >= 0 && T.cursor_y >= 0) {
+    appendMove(ab, T.cursor_x, T.cursor_y, -1, -1);
+    abAppend(ab, "\x1b[?25h", 6);
+  }
+  if (T.sync && (painted || rows > 0)) {
+    abAppend(ab, TUI_SYNC_END, strlen(TUI_SYNC_END));
+  } else if (T.sync) {
+    int skip = strlen(TUI_SYNC_BEGIN);
+    memmove(ab->buf, ab->buf + skip, ab->len - skip);
+    ab->len -= skip;
+  }
+
+  long long encoded = nowNs();
+  int bytes = ab->len;
+  int written = tui_flush();
+
+  T.stats.read_ns = T.read_ns;
+  T.stats.diff_ns = encoded - start;
+  T.stats.write_ns = nowNs() - encoded;
+  T.stats.bytes = bytes;
+  T.stats.rows = rows;
+  T.read_ns = 0;
+  return written;
+}
+
+const tui_stats *tui_last_stats(void) { return &T.stats; }
+
+/*** Input ***/
+
+// Both sizes must be powers of two, positions are free running counters that
+// get masked on access.
+#define INPUT_BUF_SIZE (1 << 14)
+#define EVENT_QUEUE_SIZE 256
+
+// A CSI longer than this is garbage (or something we don't speak), drop it.
+#define CSI_MAX_LEN 32
+
+static struct {
+  unsigned char buf[INPUT_BUF_SIZE];
+  unsigned int head; // next byte read() writes
+  unsigned int tail; // next byte the parser looks at
+  Event events[EVENT_QUEUE_SIZE];
+  unsigned int ev_head;
+  unsigned int ev_tail;
+  // Set between ESC[200~ and ESC[201~, paste collects what's in between.
+  int in_paste;
+  struct abuf paste;
+  // When the last bytes came in. A partial sequence is only taken as typed
+  // once TUI_ESC_TIMEOUT_MS went by after them.
+  long long last_read_ns;
+} In;
+
+static const char paste_end[] = "\x1b[201~";
+#define PASTE_END_LEN ((int)sizeof(paste_end) - 1)
+
+static int inputAvail(void) { return In.head - In.tail; }
+
+static unsigned char inputPeek(int i) {
+  return In.buf[(In.tail + i) & (INPUT_BUF_SIZE - 1)];
+}
+
+int tui_push_event(const Event *ev) {
+  if (In.ev_head - In.ev_tail == EVENT_QUEUE_SIZE) {
+    return -1;
+  }
+  In.events[In.ev_head++ & (EVENT_QUEUE_SIZE - 1)] = *ev;
+  return 0;
+}
+
+static void keyEvent(Event *ev, uint32_t key, int mod) {
+  *ev = (Event){.type = TUI_EVENT_KEY, .key = key, .mod = mod};
+}
+
+// Maps the final byte of an SS3 or parameterless CSI sequence.
+static uint32_t letterKey(unsigned char c) {
+  switch (c) {
+  case 'A':
+    return TUI_KEY_UP;
+  case 'B':
+    return TUI_KEY_DOWN;
+  case 'C':
+    return TUI_KEY_RIGHT;
+  case 'D':
+    return TUI_KEY_LEFT;
+  case 'H':
+    return TUI_KEY_HOME;
+  case 'F':
+    return TUI_KEY_END;
+  case 'P':
+    return TUI_KEY_F1;
+  case 'Q':
+    return TUI_KEY_F2;
+  case 'R':
+    return TUI_KEY_F3;
+  case 'S':
+    return TUI_KEY_F4;
+  }
+  return 0;
+}
+
+// Maps the first parameter of a "CSI <n> ~" sequence.
+static uint32_t tildeKey(int n) {
+  switch (n) {
+  case 1:
+  case 7:
+    return TUI_KEY_HOME;
+  case 2:
+    return TUI_KEY_INSERT;
+  case 3:
+    return TUI_KEY_DELETE;
+  case 4:
+  case 8:
+    return TUI_KEY_END;
+  case 5:
+    return TUI_KEY_PAGE_UP;
+  case 6:
+    return TUI_KEY_PAGE_DOWN;
+  case 11:
+  case 12:
+  case 13:
+  case 14:
+  case 15:
+    return TUI_KEY_F1 + (n - 11);
+  case 17:
+  case 18:
+  case 19:
+  case 20:
+  case 21:
+    return TUI_KEY_F6 + (n - 17);
+  case 23:
+  case 24:
+    return TUI_KEY_F11 + (n - 23);
+  }
+  return 0;
+}
+
+/**
+ * parseCsi: Parses "ESC [ params intermediates final" at the start of input.
+ * Returns the bytes consumed, 0 if the sequence isn't complete yet. Sequences
+ * we don't understand are consumed with ev->type set to TUI_EVENT_NONE.
+ */
+static int parseCsi(Event *ev, int avail) {
+  int params[4] = {0};
+  int param = 0; // index of the parameter being read
+  int i = 2;
+
+  for (; i < avail && i < CSI_MAX_LEN; i++) {
+    unsigned char c = inputPeek(i);
+    if (c >= '0' && c <= '9') {
+      if (param < 4) {
+        params[param] = params[param] * 10 + (c - '0');
+      }
+    } else if (c == ';') {
+      param++;
+    } else if (c >= 0x20 && c <= 0x3F) {
+      // Private markers and intermediates, nothing we map uses them.
+    } else if (c >= 0x40 && c <= 0x7E) {
+      break;
+    } else {
+      // Not a valid CSI byte, bail out and let the rest parse as keys.
+      ev->type = TUI_EVENT_NONE;
+      return i;
+    }
+  }
+  if (i >= CSI_MAX_LEN) {
+    ev->type = TUI_EVENT_NONE;
+    return i;
+  }
+  if (i >= avail) {
+    return 0;
+  }
+
+  unsigned char final = inputPeek(i);
+  int mod = params[1] > 0 ? params[1] - 1 : 0;
+  if (final == '~' && params[0] == 200) {
+    In.in_paste = 1;
+    abReset(&In.paste);
+    ev->type = TUI_EVENT_NONE;
+    return i + 1;
+  }
+  uint32_t key = final == '~' ? tildeKey(params[0]) : letterKey(final);
+  if (key == 0) {
+    ev->type = TUI_EVENT_NONE;
+  } else {
+    keyEvent(ev, key, mod);
+  }
+  return i + 1;
+}
+
+/**
+ * parseOne: Turns the bytes at the front of the ring into one event.
+ * @flush: Resolve incomplete sequences instead of waiting for more bytes.
+ *
+ * Returns the bytes consumed, 0 when more input is needed. ev->type is
+ * TUI_EVENT_NONE for sequences that were consumed but don't produce an event.
+ */
+static int parseOne(Event *ev, int avail, int flush) {
+  unsigned char c = inputPeek(0);
+
+  if (c == '\x1b') {
+    if (avail == 1) {
+      if (!flush) {
+        return 0;
+      }
+      keyEvent(ev, TUI_KEY_ESC, 0);
+      return 1;
+    }
+
+    unsigned char next = inputPeek(1);
+    if (next == '[') {
+      int n = parseCsi(ev, avail);
+      if (n == 0 && flush) {
+        keyEvent(ev, TUI_KEY_ESC, 0);
+        return 1;
+      }
+      return n;
+    }
+    if (next == 'O') {
+      if (avail < 3) {
+        if (!flush) {
+          return 0;
+        }
+        keyEvent(ev, TUI_KEY_ESC, 0);
+        return 1;
+      }
+      uint32_t key = letterKey(inputPeek(2));
+      if (key == 0) {
+        ev->type = TUI_EVENT_NONE;
+      } else {
+        keyEvent(ev, key, 0);
+      }
+      return 3;
+    }
+    // ESC followed by anything else is ESC and then that key. Treating it as
+    // Alt+key would swallow vim style "ESC j" when typed fast.
+    keyEvent(ev, TUI_KEY_ESC, 0);
+    return 1;
+  }
+
+  if (c < 0x80) {
+    keyEvent(ev, c, 0);
+    return 1;
+  }
+
+  int need;
+  uint32_t cp;
+  if ((c & 0xE0) == 0xC0) {
+    need = 1;
+    cp = c & 0x1F;
+  } else if ((c & 0xF0) == 0xE0) {
+    need = 2;
+    cp = c & 0x0F;
+  } else if ((c & 0xF8) == 0xF0) {
+    need = 3;
+    cp = c & 0x07;
+  } else {
+    keyEvent(ev, 0xFFFD, 0);
+    return 1;
+  }
+  for (int i = 1; i <= need; i++) {
+    if (i >= avail) {
+      if (!flush) {
+        return 0;
+      }
+      keyEvent(ev, 0xFFFD, 0);
+      return 1;
+    }
+    unsigned char cont = inputPeek(i);
+    if ((cont & 0xC0) != 0x80) {
+      keyEvent(ev, 0xFFFD, 0);
+      return 1;
+    }
+    cp = (cp << 6) | (cont & 0x3F);
+  }
+  keyEvent(ev, cp, 0);
+  return need + 1;
+}
+
+/**
+ * parsePaste: Moves pasted bytes from the ring into In.paste.
+ *
+ * Returns 1 once the closing marker was seen (and consumed), 0 if we ran out
+ * of input first. A marker split across two reads is left in the ring until
+ * the rest of it shows up.
+ */
+static int parsePaste(void) {
+  int avail;
+  while ((avail = inputAvail()) > 0) {
+    unsigned int start = In.tail & (INPUT_BUF_SIZE - 1);
+    int contig = INPUT_BUF_SIZE - start;
+    if (contig > avail) {
+      contig = avail;
+    }
+
+    unsigned char *esc = memchr(&In.buf[start], '\x1b', contig);
+    int run = esc ? esc - &In.buf[start] : contig;
+    if (run > 0) {
+      abAppend(&In.paste, (char *)&In.buf[start], run);
+      In.tail += run;
+      continue;
+    }
+
+    // An ESC: either the end marker, the start of one, or pasted data.
+    int i = 0;
+    while (i < PASTE_END_LEN && i < avail && inputPeek(i) == paste_end[i]) {
+      i++;
+    }
+    if (i == PASTE_END_LEN) {
+      In.tail += PASTE_END_LEN;
+      In.in_paste = 0;
+      return 1;
+    }
+    if (i == avail) {
+      return 0;
+    }
+    abAppend(&In.paste, "\x1b", 1);
+    In.tail++;
+  }
+  return 0;
+}
+
+// Parses buffered bytes into events until the input or the queue runs out.
+static void parseInput(int flush) {
+  int avail;
+  while ((avail = inputAvail()) > 0 &&
+         In.ev_head - In.ev_tail < EVENT_QUEUE_SIZE) {
+    if (In.in_paste) {
+      if (!parsePaste()) {
+        break;
+      }
+      // Hand the buffer over to the event, the next paste starts a new one.
+      Event ev = {.type = TUI_EVENT_PASTE,
+                  .paste = In.paste.buf,
+                  .paste_len = In.paste.len};
+      if (ev.paste == NULL) {
+        // Empty paste, nobody wants to free() a NULL we made up.
+        continue;
+      }
+      In.paste = (struct abuf)ABUF_INIT;
+      tui_push_event(&ev);
+      continue;
+    }
+
+    Event ev;
+    int n = parseOne(&ev, avail, flush);
+    if (n == 0) {
+      break;
+    }
+    In.tail += n;
+    if (ev.type != TUI_EVENT_NONE) {
+      tui_push_event(&ev);
+    }
+  }
+}
+
+int tui_read_input(void) {
+  int n = 0;
+  long long began = nowNs();
+
+  // A full ring makes room first, as far as the event queue takes it.
+  if (inputAvail() == INPUT_BUF_SIZE) {
+    parseInput(0);
+  }
+  int free_bytes = INPUT_BUF_SIZE - inputAvail();
+  if (free_bytes > 0) {
+    int start = In.head & (INPUT_BUF_SIZE - 1);
+    int contig = INPUT_BUF_SIZE - start;
+    if (contig > free_bytes) {
+      contig = free_bytes;
+    }
+    n = read(STDIN_FILENO, &In.buf[start], contig);
+    if (n == 0) {
+      // Only ever called once poll() said stdin is readable, so nothing
+      // there means the terminal is gone.
+      errno = EIO;
+      return -1;
+    }
+    if (n == -1) {
+      if (errno != EAGAIN && errno != EINTR) {
+        return -1;
+      }
+      n = 0;
+    }
+    if (n > 0) {
+      In.head += n;
+      In.last_read_ns = began;
+    }
+  }
+
+  // A short read, a full ring or a signal says nothing about whether the
+  // rest of a sequence is coming, only the escape timeout in tui_poll() does.
+  parseInput(0);
+  T.read_ns += nowNs() - began;
+  return n;
+}
+
+int tui_push_input(const char *s, int len) {
+  if (len > INPUT_BUF_SIZE - inputAvail()) {
+    return -1;
+  }
+  for (int i = 0; i < len; i++) {
+    In.buf[In.head++ & (INPUT_BUF_SIZE - 1)] = s[i];
+  }
+  In.last_read_ns = nowNs();
+  parseInput(0);
+  return 0;
+}
+
+int tui_input_ready(int timeout_ms) {
+  struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+  int n = poll(&pfd, 1, timeout_ms);
+  return n > 0 && (pfd.revents & POLLIN);
+}
+
+int tui_next_event(Event *ev) {
+  if (In.ev_head == In.ev_tail) {
+    // The queue may have filled up before the ring was fully parsed.
+    parseInput(0);
+    if (In.ev_head == In.ev_tail) {
+      return 0;
+    }
+  }
+  *ev = In.events[In.ev_tail++ & (EVENT_QUEUE_SIZE - 1)];
+  return 1;
+}
+
+/*** Event Loop ***/
+#define MAX_WATCHES 16
+#define MAX_TIMERS 16
+
+static struct {
+  struct {
+    int fd; // -1 for a free slot
+    short events;
+    tui_fd_cb cb;
+    void *data;
+  } watches[MAX_WATCHES];
+  struct {
+    int active;
+    long long deadline_ms;
+    int interval_ms; // 0 for one shot timers
+    tui_timer_cb cb;
+    void *data;
+  } timers[MAX_TIMERS];
+  // SIGWINCH writes a byte into winch_pipe[1], poll wakes up on [0].
+  int winch_pipe[2];
+  // A burst of them is under way: when it started and when the last one
+  // came in.
+  int winch_pending;
+  long long winch_first_ms;
+  long long winch_last_ms;
+  // stdout's flags from before we made it non-blocking, -1 if we didn't.
+  int stdout_flags;
+} L = {.winch_pipe = {-1, -1}, .stdout_flags = -1};
+
+static long long nowMs(void) { return nowNs() / 1000000; }
+
+static void handleWinch(int sig) {
+  (void)sig;
+  int saved = errno;
+  // If the pipe is full a wakeup is already pending, losing this byte is fine.
+  write(L.winch_pipe[1], "", 1);
+  errno = saved;
+}
+
+static int setNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return -1;
+  }
+  return fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+int tui_loop_init(void) {
+  for (int i = 0; i < MAX_WATCHES; i++) {
+    L.watches[i].fd = -1;
+  }
+  if (pipe(L.winch_pipe) == -1) {
+    return -1;
+  }
+  if (setNonBlocking(L.winch_pipe[0]) == -1 ||
+      setNonBlocking(L.winch_pipe[1]) == -1) {
+    tui_loop_shutdown();
+    return -1;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handleWinch;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGWINCH, &sa, NULL) == -1) {
+    tui_loop_shutdown();
+    return -1;
+  }
+
+  // A congested pty or ssh channel must not block the loop, frames that
+  // don't fit go out on POLLOUT. This also makes stdin non-blocking when
+  // both are the same tty, which tui_read_input() copes with.
+  int flags = fcntl(STDOUT_FILENO, F_GETFL);
+  if (flags != -1 && fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK) != -1) {
+    L.stdout_flags = flags;
+  }
+  return 0;
+}
+
+void tui_loop_shutdown(void) {
+  if (L.stdout_flags != -1) {
+    // Back to blocking for whoever gets the terminal next, and whatever is
+    // still queued goes out in full.
+    fcntl(STDOUT_FILENO, F_SETFL, L.stdout_flags);
+    L.stdout_flags = -1;
+    tui_flush();
+  }
+  signal(SIGWINCH, SIG_DFL);
+  L.winch_pending = 0;
+  for (int i = 0; i < 2; i++) {
+    if (L.winch_pipe[i] != -1) {
+      close(L.winch_pipe[i]);
+      L.winch_pipe[i] = -1;
+    }
+  }
+}
+
+int tui_watch_fd(int fd, short events, tui_fd_cb cb, void *data) {
+  int slot = -1;
+  for (int i = 0; i < MAX_WATCHES; i++) {
+    if (L.watches[i].fd == fd) {
+      slot = i;
+      break;
+    }
+    if (L.watches[i].fd == -1 && slot == -1) {
+      slot = i;
+    }
+  }
+  if (slot == -1) {
+    return -1;
+  }
+  L.watches[slot].fd = fd;
+  L.watches[slot].events = events;
+  L.watches[slot].cb = cb;
+  L.watches[slot].data = data;
+  return 0;
+}
+
+void tui_unwatch_fd(int fd) {
+  for (int i = 0; i < MAX_WATCHES; i++) {
+    if (L.watches[i].fd == fd) {
+      L.watches[i].fd = -1;
+    }
+  }
+}
+
+int tui_add_timer(int ms, int repeat, tui_timer_cb cb, void *data) {
+  for (int i = 0; i < MAX_TIMERS; i++) {
+    if (!L.timers[i].active) {
+      L.timers[i].active = 1;
+      L.timers[i].deadline_ms = nowMs() + ms;
+      L.timers[i].interval_ms = repeat ? ms : 0;
+      L.timers[i].cb = cb;
+      L.timers[i].data = data;
+      return i;
+    }
+  }
+  return -1;
+}
+
+void tui_cancel_timer(int id) {
+  if (id >= 0 && id < MAX_TIMERS) {
+    L.timers[id].active = 0;
+  }
+}
+
+// When the size gets read for the SIGWINCHs seen so far.
+static long long resizeDueMs(void) {
+  long long settled = L.winch_last_ms + TUI_RESIZE_SETTLE_MS;
+  long long latest = L.winch_first_ms + TUI_RESIZE_MAX_DELAY_MS;
+  return settled < latest ? settled : latest;
+}
+
+// Whether the input ends in a sequence that may still be cut short. A paste
+// waits for its end marker however long it takes, and a full event queue
+// waits for the caller.
+static int inputPartial(void) {
+  return inputAvail() > 0 && !In.in_paste &&
+         In.ev_head - In.ev_tail < EVENT_QUEUE_SIZE;
+}
+
+// When a partial sequence left in the input counts as typed.
+static long long escapeDueMs(void) {
+  return In.last_read_ns / 1000000 + TUI_ESC_TIMEOUT_MS;
+}
+
+static void queueResize(void) {
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+    return;
+  }
+  if (ws.ws_col == T.next.w && ws.ws_row == T.next.h) {
+    // Dragged back to where it started, nothing to lay out again.
+    return;
+  }
+  Event ev = {.type = TUI_EVENT_RESIZE, .w = ws.ws_col, .h = ws.ws_row};
+  tui_push_event(&ev);
+}
+
+// Fires every timer that is due, returns how many did.
+static int runTimers(void) {
+  long long now = nowMs();
+  int fired = 0;
+  for (int i = 0; i < MAX_TIMERS; i++) {
+    if (!L.timers[i].active || L.timers[i].deadline_ms > now) {
+      continue;
+    }
+    if (L.timers[i].interval_ms > 0) {
+      L.timers[i].deadline_ms = now + L.timers[i].interval_ms;
+    } else {
+      L.timers[i].active = 0;
+    }
+    L.timers[i].cb(L.timers[i].data);
+    fired++;
+  }
+  return fired;
+}
+
+int tui_poll(int timeout_ms) {
+  struct pollfd fds[MAX_WATCHES + 3];
+  int owner[MAX_WATCHES + 3]; // index into L.watches, -1 for our own fds
+  int nfds = 0;
+
+  // With the ring full (and so the event queue, or the parser would have
+  // made room) stdin stays in the kernel until the caller takes events off
+  // the queue. Polling it would only say it's readable, again and again.
+  if (inputAvail() < INPUT_BUF_SIZE) {
+    fds[nfds] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
+    owner[nfds++] = -1;
+  }
+  if (T.sent < T.out.len) {
+    fds[nfds] = (struct pollfd){.fd = STDOUT_FILENO, .events = POLLOUT};
+    owner[nfds++] = -1;
+  }
+  if (L.winch_pipe[0] != -1) {
+    fds[nfds] = (struct pollfd){.fd = L.winch_pipe[0], .events = POLLIN};
+    owner[nfds++] = -1;
+  }
+  for (int i = 0; i < MAX_WATCHES; i++) {
+    if (L.watches[i].fd != -1) {
+      fds[nfds] = (struct pollfd){.fd = L.watches[i].fd,
+                                  .events = L.watches[i].events};
+      owner[nfds++] = i;
+    }
+  }
+
+  // Wake up for the nearest timer, and for the escape timeout if there's a
+  // partial sequence sitting in the input, counted from when its last byte
+  // came in rather than from this call.
+  long long now = nowMs();
+  for (int i = 0; i < MAX_TIMERS; i++) {
+    if (L.timers[i].active) {
+      long long wait = L.timers[i].deadline_ms - now;
+      if (wait < 0) {
+        wait = 0;
+      }
+      if (timeout_ms < 0 || wait < timeout_ms) {
+        timeout_ms = wait;
+      }
+    }
+  }
+  if (L.winch_pending) {
+    long long wait = resizeDueMs() - now;
+    wait = wait < 0 ? 0 : wait;
+    if (timeout_ms < 0 || wait < timeout_ms) {
+      timeout_ms = wait;
+    }
+  }
+  if (inputPartial()) {
+    long long wait = escapeDueMs() - now;
+    wait = wait < 0 ? 0 : wait;
+    if (timeout_ms < 0 || wait < timeout_ms) {
+      timeout_ms = wait;
+    }
+  }
+
+  int n = poll(fds, nfds, timeout_ms);
+  if (n == -1) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  int dispatched = 0;
+  for (int i = 0; i < nfds && n > 0; i++) {
+    if (fds[i].revents == 0) {
+      continue;
+    }
+    if (fds[i].fd == STDIN_FILENO) {
+      if (tui_read_input() == -1) {
+        return -1;
+      }
+    } else if (fds[i].fd == STDOUT_FILENO && owner[i] == -1) {
+      if (tui_flush() == -1) {
+        return -1;
+      }
+      if (T.sent == T.out.len && T.deferred) {
+        // Caught up, send the newest state of everything we held back.
+        tui_present();
+      }
+    } else if (owner[i] == -1) {
+      char buf[64];
+      while (read(L.winch_pipe[0], buf, sizeof(buf)) > 0) {
+      }
+      // However many SIGWINCHs came in, one size query covers them all,
+      // once they stop coming.
+      long long at = nowMs();
+      if (!L.winch_pending) {
+        L.winch_pending = 1;
+        L.winch_first_ms = at;
+      }
+      L.winch_last_ms = at;
+    } else if (L.watches[owner[i]].fd == fds[i].fd) {
+      // Still watched, an earlier callback may have unwatched it.
+      L.watches[owner[i]].cb(fds[i].fd, fds[i].revents,
+                             L.watches[owner[i]].data);
+    }
+    dispatched++;
+  }
+  if (L.winch_pending && nowMs() >= resizeDueMs()) {
+    L.winch_pending = 0;
+    queueResize();
+    dispatched++;
+  }
+  if (inputPartial() && nowMs() >= escapeDueMs()) {
+    // Nothing followed the partial sequence in time, take it as typed.
+    parseInput(1);
+    dispatched++;
+  }
+  return dispatched + runTimers();
+}
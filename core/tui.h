@@ -0,0 +1,420 @@
+#ifndef TUI_H
+#define TUI_H
+
+#include <stdint.h>
+
+/*** Build Configuration ***/
+
+// Everything below is fixed when tui.c is compiled (core/Makefile passes
+// TUI_FLAGS, e.g. TUI_FLAGS="-DTUI_COLOR_DEPTH=256"), so the renderer's inner
+// loops carry no checks for it. Build the apps with the same flags.
+
+/**
+ * TUI_RENDERER: How tui_present() finds what to send.
+ * TUI_RENDER_FULL repaints every row every frame, TUI_RENDER_ROWS repaints
+ * the rows that changed at all, TUI_RENDER_CELLS sends only the cells that
+ * changed. Scrolls and the blank tail EL work the same in all three.
+ */
+#define TUI_RENDER_FULL 0
+#define TUI_RENDER_ROWS 1
+#define TUI_RENDER_CELLS 2
+#ifndef TUI_RENDERER
+#define TUI_RENDERER TUI_RENDER_CELLS
+#endif
+
+// Colors stay 0xRRGGBB in the grids either way. At 256 or 16 they are mapped
+// to the nearest xterm palette entry when the SGR is encoded, at 24 they go
+// out as they are.
+#ifndef TUI_COLOR_DEPTH
+#define TUI_COLOR_DEPTH 24
+#endif
+
+// At 0 the terminal is sent ASCII only: anything else shows up as '?', and
+// double width characters take one cell like everything else.
+#ifndef TUI_UTF8
+#define TUI_UTF8 1
+#endif
+
+/*** Append Buffer ***/
+
+// Capacity grows geometrically and survives abReset(), so a buffer that is
+// reused every frame stops allocating once it has seen its largest frame.
+struct abuf {
+  char *buf;
+  int len;
+  int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+/**
+ * abReserve: Makes room for at least n more bytes.
+ * Returns a pointer to where they go, or NULL if the allocation failed. The
+ * caller bumps ab->len by however many bytes it actually wrote.
+ */
+char *abReserve(struct abuf *ab, int n);
+void abAppend(struct abuf *ab, const char *s, int len);
+
+/**
+ * abAppendInt: Appends n in decimal, no snprintf round trip.
+ */
+void abAppendInt(struct abuf *ab, unsigned int n);
+
+/**
+ * abAppendCsi: Appends "\x1b[<a>;<b><final>". A negative b leaves the second
+ * parameter out, a negative a leaves both out.
+ * e.g. abAppendCsi(ab, row, col, 'H') or abAppendCsi(ab, col, -1, 'G').
+ */
+void abAppendCsi(struct abuf *ab, int a, int b, char final);
+
+// Drops the contents but keeps the allocation.
+void abReset(struct abuf *ab);
+void abFree(struct abuf *ab);
+
+/*** Colors ***/
+
+// Colors are packed 0xRRGGBB. TUI_DEFAULT sits outside the RGB range and means
+// "whatever the terminal's default fg/bg is" (SGR 39/49).
+typedef uint32_t tui_color;
+
+#define TUI_RGB(r, g, b)                                                       \
+  ((tui_color)(((uint32_t)(r) << 16) | ((uint32_t)(g) << 8) | (uint32_t)(b)))
+#define TUI_DEFAULT ((tui_color)0x01000000)
+
+/*** Cells ***/
+
+// One character cell on the screen. c is a unicode codepoint, or
+// TUI_CELL_CONT for the right half of the double width character to its left.
+typedef struct Cell {
+  uint32_t c;
+  tui_color fg;
+  tui_color bg;
+} Cell;
+
+#define TUI_CELL_CONT 0
+
+// A w x h grid of cells, stored row major.
+typedef struct Buffer {
+  int w, h;
+  int cap; // cells allocated, at least w * h
+  Cell *cells;
+} Buffer;
+
+/*** Renderer ***/
+
+/**
+ * tui_init: Allocates the Current and Next cell grids.
+ * @rows: Screen height in cells.
+ * @cols: Screen width in cells.
+ *
+ * The first tui_present() after this clears the terminal and paints every
+ * cell, since we have no idea what's on the screen before we start.
+ * Returns 0 on success, -1 if the grids could not be allocated.
+ */
+int tui_init(int rows, int cols);
+
+/**
+ * tui_shutdown: Frees the cell grids.
+ */
+void tui_shutdown(void);
+
+/**
+ * tui_resize: Resizes both grids for a new screen size and schedules a full
+ * repaint. The cells are only reallocated when a grid outgrows what it ever
+ * had, shrinking and growing back (a window being dragged) reuses them.
+ * Returns 0 on success, -1 on allocation failure.
+ */
+int tui_resize(int rows, int cols);
+
+int tui_width(void);
+int tui_height(void);
+
+/**
+ * tui_set_clear_attrs: Sets the colors tui_clear() fills the Next buffer with.
+ * This is also the background the terminal gets cleared to on a full repaint.
+ */
+void tui_set_clear_attrs(tui_color fg, tui_color bg);
+
+/**
+ * tui_clear: Fills the Next buffer with blanks in the clear colors.
+ */
+void tui_clear(void);
+
+/*** Drawing Primitives ***/
+
+// All drawing goes to the Next buffer, nothing hits the terminal until
+// tui_present(). Anything outside the grid is silently clipped. A double
+// width character takes two cells, one that doesn't fit before the edge is
+// drawn as a space. Zero width characters are dropped.
+void tui_draw_char(int x, int y, uint32_t c, tui_color fg, tui_color bg);
+
+/**
+ * tui_draw_str: Draws len bytes of UTF-8 starting at (x, y), clipped to the end
+ * of the row. Returns the number of cells written.
+ */
+int tui_draw_str(int x, int y, const char *s, int len, tui_color fg,
+                 tui_color bg);
+
+void tui_draw_rect(int x, int y, int w, int h, tui_color bg);
+
+/**
+ * tui_utf8_encode: Writes c as UTF-8 into out (room for 4 bytes).
+ * Returns the number of bytes written.
+ */
+int tui_utf8_encode(uint32_t c, char *out);
+
+/**
+ * tui_utf8_decode: Decodes one codepoint from s into *cp.
+ * Returns the number of bytes used, at least 1. Malformed input decodes to
+ * U+FFFD one byte at a time, the same way tui_draw_str() reads it.
+ */
+int tui_utf8_decode(const char *s, int len, uint32_t *cp);
+
+/**
+ * tui_char_width: How many cells c takes: 2 for East Asian wide and fullwidth
+ * characters and most emoji, 0 for combining marks and other zero width
+ * characters, 1 for everything else (control characters are drawn as '?').
+ */
+int tui_char_width(uint32_t c);
+
+/**
+ * tui_set_cursor: Where the cursor should sit after the next present. Pass a
+ * negative x or y to keep it hidden.
+ */
+void tui_set_cursor(int x, int y);
+
+/**
+ * tui_scroll: Scrolls rows top..bottom (inclusive) by n lines, n > 0 moves the
+ * content up (like viewing further down a file), n < 0 moves it down.
+ *
+ * Both grids are shifted right away and the next present starts by asking the
+ * terminal to do the same with a scroll region (DECSTBM + SU/SD). The rows
+ * that scroll in come up blank in the clear colors, so only those have to be
+ * drawn and sent instead of the whole region.
+ * Returns 1 if the grids were shifted, 0 if not (nothing to scroll, or a
+ * repaint is coming anyway). Then the region has to be drawn in full.
+ */
+int tui_scroll(int top, int bottom, int n);
+
+/**
+ * tui_invalidate: Forgets what the terminal is showing so the next present
+ * repaints everything. Useful when something else scribbled on the screen.
+ */
+void tui_invalidate(void);
+
+/**
+ * tui_present: Diffs Next against Current and writes only what changed.
+ *
+ * Every changed span gets a cursor move (skipped when the cursor is already
+ * there), an SGR when the colors differ from the last emitted ones, and the
+ * characters themselves. The SGR carries only the color that changed, exact
+ * palette colors go out as 5;N, and a space on the pen's background keeps
+ * whatever foreground the pen has. A changed tail of blanks is erased with EL
+ * instead of being written out space by space. The whole frame goes out in one
+ * write().
+ *
+ * Whatever the terminal doesn't take right away (once tui_loop_init() made
+ * stdout non-blocking) stays queued and tui_poll() sends it on POLLOUT. A
+ * present while a frame is still queued is deferred: the diff runs once the
+ * queue drains, against whatever Next holds by then, so a slow link skips
+ * the frames in between instead of falling further and further behind.
+ * Returns the number of bytes written now, or -1 if the write failed.
+ */
+int tui_present(void);
+
+// Synchronized output (DEC mode 2026): the terminal holds off drawing between
+// these two, so a frame shows up all at once instead of as it streams in.
+#define TUI_SYNC_BEGIN "\x1b[?2026h"
+#define TUI_SYNC_END "\x1b[?2026l"
+
+/**
+ * tui_set_sync: Wraps every frame tui_present() sends in TUI_SYNC_BEGIN/END
+ * from now on, or stops doing so. Off by default, only turn it on for a
+ * terminal that said it supports the mode. Frames that only move the cursor
+ * are sent bare, there's nothing to tear.
+ */
+void tui_set_sync(int enabled);
+
+/**
+ * tui_flush: Writes as much of the queued frame as the terminal takes without
+ * blocking. Returns the number of bytes written, or -1 on error.
+ */
+int tui_flush(void);
+
+/*** Frame Stats ***/
+
+// What one frame cost on the core's side, for instrumentation overlays.
+typedef struct tui_stats {
+  long long read_ns;  // reading and parsing input since the previous present
+  long long diff_ns;  // diffing the grids and encoding the frame
+  long long write_ns; // the write() itself, a slow terminal shows up here
+  int bytes;          // bytes written
+  int rows;           // rows that had at least one cell sent
+} tui_stats;
+
+/**
+ * tui_last_stats: Numbers for the most recent tui_present(). Stays valid until
+ * the next one overwrites it.
+ */
+const tui_stats *tui_last_stats(void);
+
+/*** Input ***/
+
+// Keys that don't map to a character live above the unicode range, so a key
+// code is either a codepoint (control bytes included) or one of these.
+enum tui_key {
+  TUI_KEY_ESC = 0x1b,
+  TUI_KEY_BACKSPACE = 0x7f,
+  TUI_KEY_UP = 0x110000,
+  TUI_KEY_DOWN,
+  TUI_KEY_RIGHT,
+  TUI_KEY_LEFT,
+  TUI_KEY_HOME,
+  TUI_KEY_END,
+  TUI_KEY_INSERT,
+  TUI_KEY_DELETE,
+  TUI_KEY_PAGE_UP,
+  TUI_KEY_PAGE_DOWN,
+  TUI_KEY_F1,
+  TUI_KEY_F2,
+  TUI_KEY_F3,
+  TUI_KEY_F4,
+  TUI_KEY_F5,
+  TUI_KEY_F6,
+  TUI_KEY_F7,
+  TUI_KEY_F8,
+  TUI_KEY_F9,
+  TUI_KEY_F10,
+  TUI_KEY_F11,
+  TUI_KEY_F12,
+};
+
+// Modifier bits, as reported in the second CSI parameter (minus one).
+#define TUI_MOD_SHIFT (1 << 0)
+#define TUI_MOD_ALT (1 << 1)
+#define TUI_MOD_CTRL (1 << 2)
+
+typedef enum {
+  TUI_EVENT_NONE,
+  TUI_EVENT_KEY,
+  TUI_EVENT_RESIZE,
+  TUI_EVENT_PASTE,
+} tui_event_type;
+
+typedef struct Event {
+  tui_event_type type;
+  uint32_t key; // TUI_EVENT_KEY: codepoint or enum tui_key
+  int mod;      // TUI_EVENT_KEY: TUI_MOD_* bits
+  int w, h;     // TUI_EVENT_RESIZE: new size in cells
+  // TUI_EVENT_PASTE: the whole bracketed paste, exactly as the terminal sent
+  // it. The caller owns it and has to free() it.
+  char *paste;
+  int paste_len;
+} Event;
+
+// Bracketed paste: the terminal wraps pasted text in ESC[200~ ... ESC[201~ so
+// it arrives as one TUI_EVENT_PASTE instead of a flood of keys.
+#define TUI_PASTE_ENABLE "\x1b[?2004h"
+#define TUI_PASTE_DISABLE "\x1b[?2004l"
+
+/**
+ * tui_read_input: Reads whatever stdin has in one read() and parses it.
+ *
+ * Bytes land in a ring buffer, the parser turns every complete sequence into
+ * an Event on the queue and leaves partial ones for the next call. Only
+ * tui_poll() flushes a partial sequence as plain keys, once no byte arrived
+ * for TUI_ESC_TIMEOUT_MS, that's how a lone ESC gets told apart from the
+ * start of an arrow key that came in two reads. Inside a bracketed paste
+ * bytes are collected verbatim until the closing marker, however many reads
+ * that takes. Meant to be called when stdin is readable, an empty read there
+ * is the terminal going away. With the ring full and the event queue too,
+ * nothing is read until events are taken off the queue.
+ * Returns the number of bytes read, or -1 on error and with errno EIO on
+ * end of file.
+ */
+int tui_read_input(void);
+
+/**
+ * tui_push_input: Hands the parser bytes someone else read off stdin, as if
+ * tui_read_input() had, e.g. keys typed while waiting on a terminal reply.
+ * Returns 0, or -1 if they don't fit in the input ring.
+ */
+int tui_push_input(const char *s, int len);
+
+/**
+ * tui_input_ready: Waits up to timeout_ms for stdin to become readable.
+ * Returns 1 if a read would not block, 0 on timeout.
+ */
+int tui_input_ready(int timeout_ms);
+
+/**
+ * tui_next_event: Pops the oldest queued event into ev.
+ * Returns 1 if there was one, 0 if the queue is empty.
+ */
+int tui_next_event(Event *ev);
+
+/**
+ * tui_push_event: Queues an event from outside the parser (e.g. a resize).
+ * Returns 0 on success, -1 if the queue is full.
+ */
+int tui_push_event(const Event *ev);
+
+/*** Event Loop ***/
+
+// One poll() loop for everything the UI waits on: stdin, SIGWINCH (through a
+// self-pipe), timers, and any fd the app registers such as a child's pipe.
+// With nothing pending it sleeps in poll() and costs no CPU at all.
+
+typedef void (*tui_fd_cb)(int fd, int revents, void *data);
+typedef void (*tui_timer_cb)(void *data);
+
+/**
+ * tui_loop_init: Creates the SIGWINCH self-pipe, installs the handler and
+ * puts stdout in non-blocking mode. tui_loop_shutdown() undoes all of it,
+ * after flushing what's still queued. Returns 0 on success, -1 on failure.
+ */
+int tui_loop_init(void);
+void tui_loop_shutdown(void);
+
+/**
+ * tui_watch_fd: Calls cb with the poll revents whenever fd is ready for any
+ * of events (POLLIN, POLLOUT, ...). Watching an fd again replaces its
+ * callback. Returns 0 on success, -1 if there are no free slots.
+ */
+int tui_watch_fd(int fd, short events, tui_fd_cb cb, void *data);
+void tui_unwatch_fd(int fd);
+
+/**
+ * tui_add_timer: Calls cb after ms milliseconds, and then every ms if repeat
+ * is set. Returns a timer id for tui_cancel_timer(), or -1 if there are no
+ * free slots.
+ */
+int tui_add_timer(int ms, int repeat, tui_timer_cb cb, void *data);
+void tui_cancel_timer(int id);
+
+/**
+ * tui_poll: Waits up to timeout_ms (-1 forever) for something to happen and
+ * dispatches it.
+ *
+ * Readable stdin is read and parsed into the event queue, due timers and
+ * ready fds get their callbacks. stdin isn't waited on while the input ring
+ * is full, the caller has queued events to get through first. A partial
+ * escape sequence left in the input is flushed as keys once
+ * TUI_ESC_TIMEOUT_MS went by since its last byte arrived, however many calls
+ * that takes. A tui_poll(0) that drains what's already waiting doesn't cut
+ * the wait short, it returns 0 and the sequence stays put.
+ *
+ * SIGWINCHs come in bursts while a window or pane divider is dragged. The
+ * size is only read once they stop for TUI_RESIZE_SETTLE_MS, or every
+ * TUI_RESIZE_MAX_DELAY_MS during a long drag, and a TUI_EVENT_RESIZE is
+ * queued only if it differs from the grids' size.
+ * Returns how many sources were dispatched, 0 on timeout, -1 on error (the
+ * terminal going away included, see tui_read_input()).
+ */
+int tui_poll(int timeout_ms);
+
+#define TUI_ESC_TIMEOUT_MS 25
+#define TUI_RESIZE_SETTLE_MS 25
+#define TUI_RESIZE_MAX_DELAY_MS 150
+
+#endif
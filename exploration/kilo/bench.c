@@ -0,0 +1,371 @@
+/**
+ * bench.c: Headless render benchmark for kilo.
+ *
+ * Links kilo.o and libtui.a, the same objects the kilo binary is made of,
+ * with the linker routing their I/O and allocator calls through the counters
+ * below (-Wl,--wrap, see the Makefile). Every frame is measured without a
+ * terminal: the bytes a frame would have sent go to a memory sink instead of
+ * stdout.
+ *
+ * Usage: kilo-bench [size...]   sizes like 1K, 4M, 1G (default 1K 1M 64M)
+ *
+ * Each size gets a generated file (kept in $TMPDIR, or /tmp, for the next run)
+ * and the same scripted scenarios, reported as ns, bytes, syscalls,
+ * allocations and frees per frame. 1G is only run when asked for.
+ */
+
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "kilo.h"
+#include "tui.h"
+
+/*** Counters ***/
+
+// Atomic since the background loader, search and save workers call these too.
+static struct {
+  // write, writev, read, poll and ioctl: every syscall the editor and the
+  // core make on the frame path, and the ones around it.
+  _Atomic long long syscalls;
+  _Atomic long long bytes;  // what would have reached the terminal
+  _Atomic long long allocs; // malloc, calloc, realloc and posix_memalign
+  _Atomic long long frees;
+} C;
+
+// What the linker renames the real functions to.
+ssize_t __real_write(int fd, const void *buf, size_t n);
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t __real_read(int fd, void *buf, size_t n);
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int __real_ioctl(int fd, unsigned long request, ...);
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t count, size_t n);
+void *__real_realloc(void *p, size_t n);
+int __real_posix_memalign(void **p, size_t align, size_t n);
+void __real_free(void *p);
+
+ssize_t __wrap_write(int fd, const void *buf, size_t n) {
+  C.syscalls++;
+  if (fd == STDOUT_FILENO) {
+    // The memory sink: count it, pretend the terminal took all of it.
+    C.bytes += n;
+    return n;
+  }
+  return __real_write(fd, buf, n);
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt) {
+  C.syscalls++;
+  return __real_writev(fd, iov, iovcnt);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t n) {
+  C.syscalls++;
+  return __real_read(fd, buf, n);
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+  C.syscalls++;
+  return __real_poll(fds, nfds, timeout);
+}
+
+// Every ioctl the editor makes takes one pointer argument.
+int __wrap_ioctl(int fd, unsigned long request, ...) {
+  va_list ap;
+  va_start(ap, request);
+  void *arg = va_arg(ap, void *);
+  va_end(ap);
+  C.syscalls++;
+  return __real_ioctl(fd, request, arg);
+}
+
+void *__wrap_malloc(size_t n) {
+  C.allocs++;
+  return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t count, size_t n) {
+  C.allocs++;
+  return __real_calloc(count, n);
+}
+
+void *__wrap_realloc(void *p, size_t n) {
+  C.allocs++;
+  return __real_realloc(p, n);
+}
+
+int __wrap_posix_memalign(void **p, size_t align, size_t n) {
+  C.allocs++;
+  return __real_posix_memalign(p, align, n);
+}
+
+void __wrap_free(void *p) {
+  if (p != NULL) {
+    C.frees++;
+  }
+  __real_free(p);
+}
+
+/*** Files ***/
+
+static long long parseSize(const char *s) {
+  char *end;
+  long long n = strtoll(s, &end, 10);
+  switch (toupper((unsigned char)*end)) {
+  case 'G':
+    n <<= 10;
+    // fallthrough
+  case 'M':
+    n <<= 10;
+    // fallthrough
+  case 'K':
+    n <<= 10;
+  }
+  return n;
+}
+
+/**
+ * benchGenerate: Writes size bytes of source-like text to path.
+ *
+ * Lines run 0 to ~120 bytes with some tab indentation and the odd multibyte
+ * character, so both the aliased and the expanded render paths get exercised.
+ * The content only depends on size, an existing file of the right size is
+ * reused.
+ */
+static void benchGenerate(const char *path, long long size) {
+  struct stat st;
+  if (stat(path, &st) == 0 && st.st_size == size) {
+    return;
+  }
+
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror(path);
+    exit(1);
+  }
+
+  static const char *words[] = {"int",    "row",    "return", "if",
+                                "render", "size",   "{",      "}",
+                                "->",     "E.rows", "for",    "caf\xc3\xa9",
+                                "=",      "0;",     "\xe2\x86\x92"};
+  int num_words = sizeof(words) / sizeof(words[0]);
+  char line[256];
+  unsigned int seed = 1;
+  long long written = 0;
+
+  while (written < size) {
+    seed = seed * 1103515245 + 12345;
+    int len = 0;
+    int tabs = (seed >> 16) % 4;
+    for (int i = 0; i < tabs; i++) {
+      line[len++] = '\t';
+    }
+    int target = (seed >> 8) % 120;
+    while (len < target) {
+      seed = seed * 1103515245 + 12345;
+      const char *w = words[(seed >> 16) % num_words];
+      int wlen = strlen(w);
+      memcpy(&line[len], w, wlen);
+      len += wlen;
+      line[len++] = ' ';
+    }
+    line[len++] = '\n';
+    if (written + len > size) {
+      len = size - written;
+    }
+    fwrite(line, 1, len, fp);
+    written += len;
+  }
+  fclose(fp);
+}
+
+/*** Scenarios ***/
+
+#define BENCH_ROWS 50
+#define BENCH_COLS 200
+#define BENCH_FRAMES 1000
+
+// Starts a fresh editor on path with a BENCH_ROWS x BENCH_COLS screen, waits
+// for the file to finish loading and draws the first frame, which is the one
+// full paint nobody wants to time.
+static void benchSetup(const char *path) {
+  editorFree();
+  memset(&E, 0, sizeof(E));
+  E.mode = NORMAL;
+  E.screen_rows = BENCH_ROWS - 1; // the status bar takes the last row
+  E.screen_cols = BENCH_COLS;
+  E.redraw = REDRAW_ROWS;
+  if (tui_init(BENCH_ROWS, BENCH_COLS) == -1) {
+    die("tui_init");
+  }
+  if (tui_loop_init() == -1) {
+    die("tui_loop_init");
+  }
+  // The loop makes stdout non-blocking for the sake of a slow terminal. Here
+  // frames go to the sink and the results go out through stdio, which would
+  // drop them on a pipe that's slow to read.
+  int flags = fcntl(STDOUT_FILENO, F_GETFL);
+  if (flags != -1) {
+    fcntl(STDOUT_FILENO, F_SETFL, flags & ~O_NONBLOCK);
+  }
+  tui_set_clear_attrs(EDITOR_FG, EDITOR_BG);
+  editorOpen((char *)path);
+  editorLoadFinish();
+  editorRefreshScreen();
+}
+
+static void frameFull(int i) {
+  (void)i;
+  tui_invalidate();
+  E.redraw |= REDRAW_ROWS;
+  editorRefreshScreen();
+}
+
+// Just the drawing into the Next buffer, no diff and no output.
+static void frameDrawRows(int i) {
+  (void)i;
+  tui_clear();
+  editorDrawRows();
+}
+
+// Type a character mid screen, then take it back, the steady state of typing.
+static void frameInsert(int i) {
+  if (i == 0) {
+    E.cur_row = E.row_offset + E.screen_rows / 2;
+    if (E.cur_row >= E.num_rows) {
+      E.cur_row = E.num_rows > 0 ? E.num_rows - 1 : 0;
+    }
+    E.cur_col = 0;
+    E.mode = INSERT;
+  }
+  editorProcessKeypress(i % 2 == 0 ? 'x' : 127);
+  editorRefreshScreen();
+}
+
+// One line per frame. The cursor rides the bottom edge down and the top edge
+// back up, so every step scrolls (as long as the file outgrows the screen).
+static void frameScroll(int i) {
+  static int dir;
+  if (i == 0) {
+    dir = 1;
+    E.mode = NORMAL;
+    E.cur_col = 0;
+    E.cur_row = E.row_offset + E.screen_rows - 1;
+  }
+  if (dir > 0 && E.cur_row >= E.num_rows - 1) {
+    dir = -1;
+    E.cur_row = E.row_offset;
+  } else if (dir < 0 && E.cur_row <= 0) {
+    dir = 1;
+    E.cur_row = E.row_offset + E.screen_rows - 1;
+  }
+  if (E.cur_row >= E.num_rows) {
+    E.cur_row = E.num_rows > 0 ? E.num_rows - 1 : 0;
+  }
+  editorProcessKeypress(dir > 0 ? ARROW_DOWN : ARROW_UP);
+  editorRefreshScreen();
+}
+
+static void frameResize(int i) {
+  if (i % 2 == 0) {
+    editorResize(BENCH_ROWS - 10, BENCH_COLS - 80);
+  } else {
+    editorResize(BENCH_ROWS, BENCH_COLS);
+  }
+  editorRefreshScreen();
+}
+
+// Searches for one of the most common words and waits for the whole file to
+// be scanned, so the frames go by the match index.
+static void setupHighlight() {
+  editorSearchSet("row", 3);
+  while (E.search.active) {
+    editorSearchAbsorb();
+  }
+  editorRefreshScreen();
+}
+
+// Drawing the rows again with a match or two on each of them.
+static void frameHighlight(int i) {
+  (void)i;
+  tui_clear();
+  editorDrawRows();
+}
+
+static const struct {
+  const char *name;
+  void (*frame)(int i);
+  void (*setup)(); // untimed, after the editor is set up
+} scenarios[] = {
+    {"full redraw", frameFull, NULL},
+    {"draw rows", frameDrawRows, NULL},
+    {"insert char", frameInsert, NULL},
+    {"scroll", frameScroll, NULL},
+    {"resize", frameResize, NULL},
+    {"highlights", frameHighlight, setupHighlight},
+};
+
+static void benchFile(const char *size_arg) {
+  long long size = parseSize(size_arg);
+  const char *dir = getenv("TMPDIR");
+  char path[512];
+  snprintf(path, sizeof(path), "%s/kilo-bench-%lld.txt", dir ? dir : "/tmp",
+           size);
+  benchGenerate(path, size);
+
+  long long start = monotonicNs();
+  benchSetup(path);
+  printf("%s: %lld bytes, %d rows, loaded in %.1f ms\n", size_arg, size,
+         E.num_rows, (monotonicNs() - start) / 1e6);
+  printf("  %-12s %8s %12s %12s %15s %13s %12s\n", "scenario", "frames",
+         "ns/frame", "bytes/frame", "syscalls/frame", "allocs/frame",
+         "frees/frame");
+
+  int num_scenarios = sizeof(scenarios) / sizeof(scenarios[0]);
+  for (int s = 0; s < num_scenarios; s++) {
+    benchSetup(path);
+    if (scenarios[s].setup != NULL) {
+      scenarios[s].setup();
+    }
+    C.syscalls = 0;
+    C.bytes = 0;
+    C.allocs = 0;
+    C.frees = 0;
+    start = monotonicNs();
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+      scenarios[s].frame(i);
+    }
+    double ns = monotonicNs() - start;
+    printf("  %-12s %8d %12.0f %12.1f %15.2f %13.2f %12.2f\n",
+           scenarios[s].name, BENCH_FRAMES, ns / BENCH_FRAMES,
+           (double)C.bytes / BENCH_FRAMES, (double)C.syscalls / BENCH_FRAMES,
+           (double)C.allocs / BENCH_FRAMES, (double)C.frees / BENCH_FRAMES);
+  }
+  printf("\n");
+}
+
+// kilo.o has a main of its own, the linker starts this one instead.
+int __wrap_main(int argc, char *argv[]) {
+  static char *defaults[] = {"1K", "1M", "64M"};
+  char **sizes = argc > 1 ? &argv[1] : defaults;
+  int num_sizes = argc > 1 ? argc - 1 : 3;
+
+  for (int i = 0; i < num_sizes; i++) {
+    benchFile(sizes[i]);
+  }
+  editorFree();
+  return 0;
+}
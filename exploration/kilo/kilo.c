@@ -1,13 +1,37 @@
+// getline(), clock_gettime() and friends are hidden behind these when
+// compiling with a strict -std.
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "kilo.h"
+#include "tui.h"
+
 /**
  * Ctrl key strips bits 5 and 6 from whatever key you press in combination with
  * it. We are duplicating that behaviour here by setting the top 3 bits to 0.
@@ -16,125 +40,380 @@
 
 #define KILO_VERSION "0.0.1"
 
-typedef struct erow {
-  int size;
-  int rsize;
-  char *contents;
-  char *render;
-} erow;
+// Whether to ask the terminal about synchronized output (DEC mode 2026) at
+// startup and wrap every frame in it if supported. 0 never uses it.
+#ifndef KILO_SYNC_OUTPUT
+#define KILO_SYNC_OUTPUT 1
+#endif
+// How long to wait on each byte of the terminal's answer to that.
+#define SYNC_PROBE_TIMEOUT_MS 100
+
+// Upper bound on frames per second. Input arriving faster than this is folded
+// into the next frame instead of each key getting its own. 0 disables the cap.
+#ifndef KILO_MAX_FPS
+#define KILO_MAX_FPS 120
+#endif
+
+#if KILO_HUD
+// Counts the editor's allocator calls for the HUD.
+// Atomic because the loader thread allocates too.
+static _Atomic long long hud_allocs;
+static void *hudMalloc(size_t n) {
+  hud_allocs++;
+  return malloc(n);
+}
+static void *hudRealloc(void *p, size_t n) {
+  hud_allocs++;
+  return realloc(p, n);
+}
+#define malloc hudMalloc
+#define realloc hudRealloc
+#endif
+
+// Smallest gap we open up when a row runs out of room.
+#define ROW_GAP_MIN 16
+
+#define TAB_STOP 8
+
+// Files bigger than the first chunk are indexed in the background. Chunks
+// start small so the first screen is up right away, and double from there.
+#define LOAD_CHUNK_MIN (256 << 10)
+#define LOAD_CHUNK_MAX (16 << 20)
+
+// Past LOAD_CHUNK_MAX the loader scans that much per thread at once, with
+// KILO_LOAD_THREADS threads (0 for one per online CPU, up to
+// LOAD_THREADS_MAX).
+#ifndef KILO_LOAD_THREADS
+#define KILO_LOAD_THREADS 0
+#endif
+#define LOAD_THREADS_MAX 64
+
+// The search worker goes through the mapping this many bytes at a time and
+// publishes what it found after each, that's also how often it checks whether
+// the query changed under it.
+#define SEARCH_CHUNK (4 << 20)
+
+// Undo payloads are kept in chunks this big.
+#define UNDO_CHUNK (64 << 10)
+
+// The saver writes at most this many bytes (and SAVE_IOV_MAX iovecs) per
+// writev, and reports progress after each. Edited rows are copied into
+// SAVE_COPY_CHUNK sized blocks.
+#define SAVE_BATCH (4 << 20)
+#define SAVE_IOV_MAX 1024
+#define SAVE_COPY_CHUNK (1 << 20)
+
+// Once owned render strings add up to more than this, the ones outside the
+// viewport get thrown away. They're rebuilt if the row scrolls back in.
+#define RENDER_CACHE_MAX (8 << 20)
+
+static inline renderMark *renderMarks(rowRender *r) {
+  return (renderMark *)(r->text + r->marks_at);
+}
 
-/*** Append Buffer ***/
-struct abuf {
-  char *buf;
-  int len;
-};
+#define ROW_INLINE_MAX ((int)sizeof(rowText))
 
-// We're going vim mode boiz. Maybe not the FULL THING, but at least some
-// semblance of it.
-typedef enum { NORMAL, INSERT, VISUAL } mode;
-
-// We're blaspheming as well. WERE ALIASING hjkl as arrow KEYS
-// :evil_laugh_if_thats_even_an_emote:
-enum editor_key {
-  ARROW_LEFT = 'h',
-  ARROW_RIGHT = 'l',
-  ARROW_UP = 'k',
-  ARROW_DOWN = 'j',
-};
+// A row's text as the spans before and after its gap, however it's stored.
+// Readers walk both instead of flattening.
+typedef struct rowSpans {
+  const char *head;
+  int head_len;
+  const char *tail;
+  int tail_len;
+} rowSpans;
 
-#define ABUF_INIT {NULL, 0}
+// Search matches.
+#define MATCH_FG TUI_RGB(40, 40, 40)
+#define MATCH_BG TUI_RGB(250, 189, 47)
 
 void editorAppendRow(char *s, size_t len);
+void editorDropRender(int at);
+const char *editorRowRender(int at, int *rsize);
+void editorTrimRenderCache();
+int editorRowCxToRx(int at, int cx);
+int editorRenderSkip(int at, int col, int *pad);
+void editorLoadWait();
+void editorLoadStop();
+void editorEnsureRow();
+int editorRowFind(int r, int from, int to, int dir);
+void editorSearchJump(int dir);
+void editorSearchStop();
+void editorSearchContinue();
+void undoRecord(int kind, int row, int col, const char *s, int len);
+void undoFree();
+void editorUndo();
+void editorRedo();
+
+void lineIndexFree(lineIndex *idx);
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->buf, ab->len + len);
+struct editorConfig E;
 
-  if (new == NULL) {
+// For editorDamageRows(), when everything from some row down moved.
+#define DAMAGE_TO_END INT_MAX
+
+/**
+ * editorDamageRows: Records that file rows [from, to) need a repaint.
+ *
+ * Every change to the text calls this, so a frame only redraws what's
+ * actually different. Damage from several changes between two frames is
+ * merged into one range covering all of them, which is all typing and
+ * pasting ever produces anyway.
+ */
+void editorDamageRows(int from, int to) {
+  if (!(E.redraw & REDRAW_DAMAGE)) {
+    E.damage_from = from;
+    E.damage_to = to;
+  } else {
+    E.damage_from = from < E.damage_from ? from : E.damage_from;
+    E.damage_to = to > E.damage_to ? to : E.damage_to;
+  }
+  E.redraw |= REDRAW_DAMAGE;
+}
+
+/*** utility ***/
+// Where the cursor sits on screen, tabs push it further right than cur_col.
+// While a search is typed it's at the end of the query in the status bar.
+void editorPlaceCursor() {
+  if (E.search.prompt) {
+    int x = 1;
+    for (int i = 0; i < E.search.query_len;) {
+      uint32_t cp;
+      i += tui_utf8_decode(&E.search.query[i], E.search.query_len - i, &cp);
+      x += tui_char_width(cp);
+    }
+    tui_set_cursor(x, E.screen_rows);
     return;
   }
-  memcpy(&new[ab->len], s, len);
-  ab->buf = new;
-  ab->len += len;
+  int rx = E.cur_col;
+  if (E.cur_row < E.num_rows) {
+    rx = editorRowCxToRx(E.cur_row, E.cur_col);
+  }
+  tui_set_cursor(rx - E.col_offset, E.cur_row - E.row_offset);
 }
 
-void abFree(struct abuf *ab) { free(ab->buf); }
+long long monotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-/*** Data ***/
-struct editorConfig {
-  int cur_row;
-  int cur_col;
-  int row_offset;
-  int screen_rows;
-  int screen_cols;
-  struct termios original_termios;
-  mode mode;
-  int num_rows;
-  int row_capacity;
-  erow *rows;
-};
+/*** output ***/
 
-struct editorConfig E;
+/**
+ * editorDrawMatches: Draws the search matches in file row r (on screen row y)
+ * again, in the match colors.
+ *
+ * A match is text bytes [cx, cx + query_len), which the column index turns
+ * into screen columns and those into render bytes, so tabs and wide glyphs
+ * inside or before it land where the plain draw put them.
+ */
+static void editorDrawMatches(int y, int r) {
+  int size = E.rows[r].size;
+  int rsize;
+  const char *render = editorRowRender(r, &rsize);
+  int right = E.col_offset + E.screen_cols;
+  for (int cx = editorRowFind(r, 0, size, 1); cx != -1;
+       cx = editorRowFind(r, cx + 1, size, 1)) {
+    int from = editorRowCxToRx(r, cx);
+    int to = editorRowCxToRx(r, cx + E.search.query_len);
+    if (from >= right) {
+      break;
+    }
+    if (to <= E.col_offset) {
+      continue;
+    }
+    int pad;
+    int b0 = editorRenderSkip(r, from > E.col_offset ? from : E.col_offset,
+                              &pad);
+    int x = (from > E.col_offset ? from : E.col_offset) - E.col_offset + pad;
+    int b1 = editorRenderSkip(r, to, &pad);
+    tui_draw_str(x, y, render + b0, b1 - b0, MATCH_FG, MATCH_BG);
+  }
+}
 
-/*** utility ***/
-void hideCursor(struct abuf *ab) { abAppend(ab, "\x1b[?25l", 6); }
+// Draws the visible rows into the renderer's Next buffer. Nothing is written
+// to the terminal here, tui_present() works out what actually changed.
+// Draws screen row y over whatever blank the caller left there.
+static void editorDrawRow(int y) {
+  int file_row = y + E.row_offset;
+  if (file_row < E.num_rows) {
+    int rsize;
+    const char *render = editorRowRender(file_row, &rsize);
+    int pad;
+    int skip = editorRenderSkip(file_row, E.col_offset, &pad);
+    tui_draw_str(pad, y, render + skip, rsize - skip, EDITOR_FG, EDITOR_BG);
+    if (E.search.query_len > 0) {
+      editorDrawMatches(y, file_row);
+    }
+  } else {
+    tui_draw_char(0, y, '~', EDITOR_FG, EDITOR_BG);
+  }
+}
 
-void showCursor(struct abuf *ab) { abAppend(ab, "\x1b[?25h", 6); }
+void editorDrawRows() {
+  int y;
+  for (y = 0; y < E.screen_rows; ++y) {
+    editorDrawRow(y);
+  }
 
-void resetCrusorPosition(struct abuf *ab) {
-  // Reposition curosr to (1,1) (row, col).
-  // You can write it as \x1b[row;colH, to set it to (row, col) but the defaults
-  // are 1 so we don't need to specify them.
-  abAppend(ab, "\x1b[H", 3);
+  if (E.render_bytes > RENDER_CACHE_MAX) {
+    editorTrimRenderCache();
+  }
 }
 
-void moveCursor(int rows, int cols) {
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", rows, cols);
-  write(STDOUT_FILENO, buf, strlen(buf));
+/**
+ * editorDrawDamage: Repaints just the damaged rows that are on screen, the
+ * rest of the Next buffer still holds the last frame.
+ */
+void editorDrawDamage() {
+  int from = E.damage_from - E.row_offset;
+  int to = E.damage_to - E.row_offset;
+  if (from < 0) {
+    from = 0;
+  }
+  if (to > E.screen_rows) {
+    to = E.screen_rows;
+  }
+  for (int y = from; y < to; y++) {
+    tui_draw_rect(0, y, E.screen_cols, 1, EDITOR_BG);
+    editorDrawRow(y);
+  }
+
+  if (E.render_bytes > RENDER_CACHE_MAX) {
+    editorTrimRenderCache();
+  }
 }
 
-void moveCursorToCurrentPos() {
-  moveCursor((E.cur_row - E.row_offset) + 1, E.cur_col + 1);
+#if KILO_HUD
+#define HUD_FG TUI_RGB(255, 255, 255)
+#define HUD_BG TUI_RGB(120, 40, 40)
+
+// Draws the last frame's numbers over the top right corner.
+void editorHudDraw() {
+  struct hud *h = &E.hud;
+  char buf[160];
+  int len = snprintf(buf, sizeof(buf),
+                     " frame %lldus | read %lld upd %lld draw %lld diff %lld "
+                     "write %lld | %dB %d rows %d allocs ",
+                     h->frame_ns / 1000, h->read_ns / 1000,
+                     h->update_ns / 1000, h->draw_ns / 1000,
+                     h->diff_ns / 1000, h->write_ns / 1000, h->bytes, h->rows,
+                     h->frame_allocs);
+  if (len >= (int)sizeof(buf)) {
+    len = sizeof(buf) - 1;
+  }
+  // Cursor-only frames don't repaint what's under the HUD, so it never gets
+  // narrower while shown or a shorter line would leave old text behind.
+  if (len > h->width) {
+    h->width = len;
+  }
+  int x = E.screen_cols > h->width ? E.screen_cols - h->width : 0;
+  tui_draw_rect(x, 0, h->width - len, 1, HUD_BG);
+  tui_draw_str(x + h->width - len, 0, buf, len, HUD_FG, HUD_BG);
 }
 
-/**
- * clearScreen - clears the screen
- * \x1b[wJ: Is an escape sequence.
- *    \x1b is the escape character (27), it's followed by '['.
- *    2J tells the terminal to clear the whole screen.
- *    1J would mean clear from top till the cursor.
- *    0J would mean clear from cursor to bottom.
- *    0, 1, and 2 are arguments.
- */
-void clearScreen(struct abuf *ab) {
-  abAppend(ab, "\x1b[48;2;40;40;40m", 16); // Set background #282828
-  // Clear whole screen
-  abAppend(ab, "\x1b[2J", 4);
-  resetCrusorPosition(ab);
+// Collects what the frame that was just presented cost.
+void editorHudRecord(long long draw_ns) {
+  struct hud *h = &E.hud;
+  const tui_stats *st = tui_last_stats();
+  h->read_ns = st->read_ns;
+  h->update_ns = h->pending_update_ns;
+  h->draw_ns = draw_ns;
+  h->diff_ns = st->diff_ns;
+  h->write_ns = st->write_ns;
+  h->bytes = st->bytes;
+  h->rows = st->rows;
+  h->frame_allocs = hud_allocs - h->allocs;
+  h->allocs = hud_allocs;
+  h->frame_ns = h->read_ns + h->update_ns + h->draw_ns + h->diff_ns +
+                h->write_ns;
+
+  if (h->trace != NULL) {
+    fprintf(h->trace, "%lld %lld %lld %lld %lld %lld %d %d %d\n", h->frame_ns,
+            h->read_ns, h->update_ns, h->draw_ns, h->diff_ns, h->write_ns,
+            h->bytes, h->rows, h->frame_allocs);
+  }
+  h->pending_update_ns = 0;
 }
+#endif
+
+#define STATUS_FG TUI_RGB(40, 40, 40)
+#define STATUS_BG TUI_RGB(213, 196, 161)
+
+// The row below the text: file name and line count, load progress while the
+// file is still being indexed, how the search is doing and where the cursor
+// is. While a search is typed it's the prompt instead.
+void editorDrawStatusBar() {
+  int y = E.screen_rows;
+  tui_draw_rect(0, y, E.screen_cols, 1, STATUS_BG);
+  if (E.search.prompt) {
+    tui_draw_char(0, y, '/', STATUS_FG, STATUS_BG);
+    tui_draw_str(1, y, E.search.query, E.search.query_len, STATUS_FG,
+                 STATUS_BG);
+    return;
+  }
 
-/*** output ***/
-void editorDrawRows(struct abuf *ab) {
-  int y;
-  for (y = 0; y < E.screen_rows; ++y) {
-    int file_row = y + E.row_offset;
-    if (file_row < E.num_rows) {
-      int len = E.rows[file_row].size;
-      if (len > E.screen_cols) {
-        len = E.screen_cols;
-      }
-      abAppend(ab, E.rows[file_row].contents, len);
-    } else {
-      abAppend(ab, "~", 1);
-    }
-    abAppend(ab, "\x1b[K", 3);
-    if (y < E.screen_rows - 1) {
-      abAppend(ab, "\r\n", 2);
-    }
+  char left[256];
+  char right[32];
+  const char *name = E.filename != NULL ? E.filename : "[No Name]";
+  const char *mode = E.mode == INSERT ? " -- INSERT --" : "";
+  char search[96] = "";
+  if (E.search.not_found) {
+    snprintf(search, sizeof(search), " - /%.*s not found",
+             E.search.query_len, E.search.query);
+  } else if (E.search.active) {
+    int percent =
+        E.map_size > 0 ? E.search.progress * 100 / E.map_size : 100;
+    snprintf(search, sizeof(search), " - /%.*s searching %d%%",
+             E.search.query_len, E.search.query, percent);
+  }
+  char save[96] = "";
+  if (E.save.active) {
+    int percent =
+        E.save.total > 0 ? E.save.progress * 100 / E.save.total : 100;
+    snprintf(save, sizeof(save), " - saving %d%%", percent);
+  } else if (E.save.result > 0) {
+    snprintf(save, sizeof(save), " - %zu bytes written",
+             E.save.result_bytes);
+  } else if (E.save.result < 0) {
+    snprintf(save, sizeof(save), " - can't save: %s",
+             strerror(E.save.result_error));
+  }
+  int llen;
+  if (E.load.active) {
+    int percent = E.map_size > 0 ? E.load.progress * 100 / E.map_size : 100;
+    llen = snprintf(left, sizeof(left),
+                    " %.40s - %d lines, loading %d%%%s%s%s", name, E.num_rows,
+                    percent, mode, search, save);
+  } else {
+    llen = snprintf(left, sizeof(left), " %.40s - %d lines%s%s%s", name,
+                    E.num_rows, mode, search, save);
+  }
+  int rlen = snprintf(right, sizeof(right), "%d/%d ", E.cur_row + 1,
+                      E.num_rows);
+  if (llen >= (int)sizeof(left)) {
+    llen = sizeof(left) - 1;
+  }
+
+  tui_draw_str(0, y, left, llen, STATUS_FG, STATUS_BG);
+  if (llen + rlen < E.screen_cols) {
+    tui_draw_str(E.screen_cols - rlen, y, right, rlen, STATUS_FG, STATUS_BG);
   }
 }
 
+// Returns whether the view scrolled vertically. Scrolling sideways always
+// repaints everything, that's taken care of here.
 int editorScroll() {
+  int rx = E.cur_row < E.num_rows ? editorRowCxToRx(E.cur_row, E.cur_col) : 0;
+  if (rx < E.col_offset) {
+    E.col_offset = rx;
+    E.redraw |= REDRAW_ROWS;
+  }
+  if (rx >= E.col_offset + E.screen_cols) {
+    E.col_offset = rx - E.screen_cols + 1;
+    E.redraw |= REDRAW_ROWS;
+  }
+
   int scrolled = 0;
   if (E.cur_row < E.row_offset) {
     E.row_offset = E.cur_row;
@@ -147,47 +426,248 @@ int editorScroll() {
   return scrolled;
 }
 
+/**
+ * editorRefreshScreen: Renders one frame for everything E.redraw collected.
+ *
+ * When only the cursor moved the Next buffer is left alone, so presenting just
+ * emits the cursor move. Damaged rows are the only ones drawn again. When the
+ * view scrolled the terminal is told to scroll too, and the rows that came
+ * into view count as damage.
+ */
 void editorRefreshScreen() {
-  editorScroll();
+  int old_offset = E.row_offset;
+  if (editorScroll()) {
+    // Let the terminal move what's still visible, only the rows that scroll
+    // in get drawn and sent.
+    int n = E.row_offset - old_offset;
+    if (!tui_scroll(0, E.screen_rows - 1, n)) {
+      E.redraw |= REDRAW_ROWS;
+    } else if (n > 0) {
+      editorDamageRows(E.row_offset + E.screen_rows - n,
+                       E.row_offset + E.screen_rows);
+    } else {
+      editorDamageRows(E.row_offset, E.row_offset - n);
+    }
+#if KILO_HUD
+    // The HUD scrolled along with the text.
+    if (E.hud.visible) {
+      E.redraw |= REDRAW_ROWS;
+    }
+#endif
+  }
 
-  struct abuf ab = ABUF_INIT;
+#if KILO_HUD
+  long long draw_start = monotonicNs();
+#endif
+  if (E.redraw & REDRAW_ROWS) {
+    tui_clear();
+    editorDrawRows();
+  } else if (E.redraw & REDRAW_DAMAGE) {
+    editorDrawDamage();
+  }
+  // Cheap enough to redo every frame, and the cursor position in it changes
+  // with nearly every one.
+  editorDrawStatusBar();
+#if KILO_HUD
+  if (E.hud.visible) {
+    editorHudDraw();
+  }
+  long long draw_ns = monotonicNs() - draw_start;
+#endif
+  editorPlaceCursor();
+  tui_present();
+#if KILO_HUD
+  editorHudRecord(draw_ns);
+#endif
+
+  E.redraw = 0;
+  E.last_frame_ns = monotonicNs();
+}
 
-  hideCursor(&ab);
-  abAppend(&ab, "\x1b[48;2;40;40;40m", 16); // Set background #282828
-  resetCrusorPosition(&ab);
-  editorDrawRows(&ab);
+/*** Slab ***/
 
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cur_row - E.row_offset) + 1,
-           E.cur_col + 1);
-  abAppend(&ab, buf, strlen(buf));
+static int slabClass(size_t n) {
+  int c = 0;
+  while (((size_t)SLAB_MIN << c) < n) {
+    c++;
+  }
+  return c;
+}
+
+// How many bytes a request for n actually gets.
+size_t slabCapacity(size_t n) {
+  return n > SLAB_MAX ? n : (size_t)SLAB_MIN << slabClass(n);
+}
+
+/**
+ * slabAlloc: Returns a block of at least n bytes (slabCapacity(n) exactly),
+ * or NULL if memory ran out.
+ */
+void *slabAlloc(struct slab *s, size_t n) {
+  if (n > SLAB_MAX) {
+    slabBig *b = malloc(sizeof(slabBig) + n);
+    if (b == NULL) {
+      return NULL;
+    }
+    b->prev = NULL;
+    b->next = s->big;
+    if (s->big != NULL) {
+      s->big->prev = b;
+    }
+    s->big = b;
+    return b + 1;
+  }
+
+  int c = slabClass(n);
+  if (s->free[c] != NULL) {
+    void *p = s->free[c];
+    s->free[c] = *(void **)p;
+    return p;
+  }
+
+  size_t cap = (size_t)SLAB_MIN << c;
+  if (s->bump_left < cap) {
+    // Whatever is left of the old chunk is smaller than this class, let it go.
+    char *chunk = malloc(SLAB_CHUNK);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    *(void **)chunk = s->chunks;
+    s->chunks = chunk;
+    // The link takes up the first SLAB_MIN bytes, so blocks stay aligned.
+    s->bump = chunk + SLAB_MIN;
+    s->bump_left = SLAB_CHUNK - SLAB_MIN;
+  }
+  void *p = s->bump;
+  s->bump += cap;
+  s->bump_left -= cap;
+  return p;
+}
+
+// Gives back a block from slabAlloc(), cap being its slabCapacity().
+void slabFree(struct slab *s, void *p, size_t cap) {
+  if (p == NULL) {
+    return;
+  }
+  if (cap > SLAB_MAX) {
+    slabBig *b = (slabBig *)p - 1;
+    if (b->prev != NULL) {
+      b->prev->next = b->next;
+    } else {
+      s->big = b->next;
+    }
+    if (b->next != NULL) {
+      b->next->prev = b->prev;
+    }
+    free(b);
+    return;
+  }
+  int c = slabClass(cap);
+  *(void **)p = s->free[c];
+  s->free[c] = p;
+}
+
+/**
+ * slabRealloc: Moves the old_cap bytes at p into a block of at least n bytes.
+ * Big blocks are realloc()ed in place when possible. Returns NULL if memory
+ * ran out, p is still valid then.
+ */
+void *slabRealloc(struct slab *s, void *p, size_t old_cap, size_t n) {
+  if (p != NULL && old_cap > SLAB_MAX && n > SLAB_MAX) {
+    slabBig *b = realloc((slabBig *)p - 1, sizeof(slabBig) + n);
+    if (b == NULL) {
+      return NULL;
+    }
+    if (b->prev != NULL) {
+      b->prev->next = b;
+    } else {
+      s->big = b;
+    }
+    if (b->next != NULL) {
+      b->next->prev = b;
+    }
+    return b + 1;
+  }
 
-  showCursor(&ab);
+  void *new = slabAlloc(s, n);
+  if (new == NULL) {
+    return NULL;
+  }
+  if (p != NULL) {
+    memcpy(new, p, old_cap < n ? old_cap : n);
+    slabFree(s, p, old_cap);
+  }
+  return new;
+}
 
-  write(STDOUT_FILENO, ab.buf, ab.len);
-  abFree(&ab);
+// Frees everything at once, in O(chunks).
+void slabRelease(struct slab *s) {
+  while (s->chunks != NULL) {
+    void *next = *(void **)s->chunks;
+    free(s->chunks);
+    s->chunks = next;
+  }
+  while (s->big != NULL) {
+    slabBig *next = s->big->next;
+    free(s->big);
+    s->big = next;
+  }
+  memset(s, 0, sizeof(*s));
 }
 
 /*** Terminal Attributes and Configuration ***/
 void editorFree() {
-  if (E.rows != NULL) {
-    for (int i = 0; i < E.num_rows; i++) {
-      free(E.rows[i].contents);
-    }
-    free(E.rows);
+  // The loader and the search read the mapping, stop them before anything
+  // goes away.
+  editorLoadStop();
+  editorSearchStop();
+  lineIndexFree(&E.search.matches);
+  E.search.query_len = 0;
+  // A save under way reads the mapping too. It gets to finish, whoever
+  // asked for it still wants the file written.
+  editorSaveStop();
+  undoFree();
+  // Row text and renders all live in the slab, no need to visit every row.
+  free(E.rows);
+  free(E.text);
+  // die() frees before exiting and atexit runs us again.
+  E.rows = NULL;
+  E.text = NULL;
+  E.num_rows = 0;
+  E.row_capacity = 0;
+  slabRelease(&E.slab);
+  E.render_bytes = 0;
+  if (E.map != NULL) {
+    munmap(E.map, E.map_size);
+    E.map = NULL;
+  }
+  tui_loop_shutdown();
+  tui_shutdown();
+#if KILO_HUD
+  if (E.hud.trace != NULL) {
+    fclose(E.hud.trace);
+    E.hud.trace = NULL;
   }
+#endif
 }
 
 /**
- * die: Prints out an error and exits the process.
+ * die: Clears the screen, prints out an error and exits the process.
  * @s: String error to be outputted, with the perror.
+ *
+ * The core goes down first. That puts stdout back to blocking and sends
+ * whatever frame was still queued in full, so the clear can't land inside
+ * half an escape sequence or have a stale frame painted over it. The clear
+ * itself goes out straight, die() is also what a failed tui_init() or flush
+ * ends up in. The colors are reset first so the screen is left blank in the
+ * terminal's own, not the editor's background.
  */
 void die(const char *s) {
-  struct abuf ab = ABUF_INIT;
-  clearScreen(&ab);
-  abFree(&ab);
-
+  int saved = errno;
   editorFree();
+  write(STDOUT_FILENO, "\x1b[0m\x1b[2J\x1b[H", 11);
+
+  errno = saved;
   perror(s);
   exit(1);
 }
@@ -202,6 +682,7 @@ void die(const char *s) {
  */
 void disableRawMode() {
   write(STDOUT_FILENO, "\x1b[0m", 4); // Reset colors
+  write(STDOUT_FILENO, TUI_PASTE_DISABLE, strlen(TUI_PASTE_DISABLE));
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.original_termios) == -1) {
     die("tcsetattr");
   }
@@ -276,7 +757,10 @@ void enableRawMode() {
 
   // VTIME: Timeout in deciseconds for noncanonical read (TIME).
   // Returns 0 after 0.1 x n seconds n begin the value provided.
-  new_attributes.c_cc[VTIME] = 1;
+  // We leave it at 0: the event loop blocks in poll() and only reads once
+  // there's something to read, so read() never has to wait (and we don't wake
+  // up every 100ms for nothing).
+  new_attributes.c_cc[VTIME] = 0;
 
   // Set the attributes \['_']/
   // TCSAFLUSH specifies when to apply the change. In our case it'll wait for
@@ -285,225 +769,2514 @@ void enableRawMode() {
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &new_attributes) == -1) {
     die("tcsetattr");
   }
+
+  // Bracketed paste, so a paste shows up as one event we can insert in bulk
+  // instead of thousands of single key presses.
+  write(STDOUT_FILENO, TUI_PASTE_ENABLE, strlen(TUI_PASTE_ENABLE));
 }
 
-char editorReadKey() {
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) {
-      die("read");
-    }
+/**
+ * editorMapKey: Turns an input event's key into what editorProcessKeypress
+ * expects. Arrow keys become their hjkl aliases.
+ */
+int editorMapKey(const Event *ev) {
+  switch (ev->key) {
+  case TUI_KEY_UP:
+    return ARROW_UP;
+  case TUI_KEY_DOWN:
+    return ARROW_DOWN;
+  case TUI_KEY_RIGHT:
+    return ARROW_RIGHT;
+  case TUI_KEY_LEFT:
+    return ARROW_LEFT;
   }
+  return ev->key;
+}
 
-  if (c == '\x1b') {
-    char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) {
-      printf("didn't read the 1st byte");
-      return '\x1b';
+/**
+ * textIsPlain: Whether s is all ASCII without tabs, so every byte is exactly
+ * one screen column. Checks 16 bytes at a time with SSE2 or NEON.
+ */
+static int textIsPlain(const char *s, int len) {
+  int i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  const __m128i tab = _mm_set1_epi8('\t');
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    // A tab compares to 0xff, so either way the top bit ends up set.
+    if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, tab))) != 0) {
+      return 0;
     }
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) {
-      printf("didn't read the 2nd byte");
-      return '\x1b';
+  }
+#elif defined(__aarch64__)
+  const uint8x16_t tab = vdupq_n_u8('\t');
+  const uint8x16_t high = vdupq_n_u8(0x80);
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)s + i);
+    if (vmaxvq_u8(vorrq_u8(vcgeq_u8(v, high), vceqq_u8(v, tab))) != 0) {
+      return 0;
     }
-    if (seq[0] == '[') {
-      printf("%c, %c", seq[1], seq[2]);
-      switch (seq[1]) {
-      case 'A':
-        return ARROW_UP;
-      case 'B':
-        return ARROW_DOWN;
-      case 'C':
-        return ARROW_RIGHT;
-      case 'D':
-        return ARROW_LEFT;
-      }
+  }
+#endif
+  for (; i < len; i++) {
+    unsigned char c = s[i];
+    if (c >= 0x80 || c == '\t') {
+      return 0;
     }
-    return '\x1b';
-  } else {
-    return c;
   }
-  return c;
+  return 1;
 }
 
-void editorUpdateRow(erow *row) {
-  free(row->render);
-  row->render = malloc(row->size + 1);
-
-  int j;
-  int idx = 0;
-
-  for (j = 0; j < row->size; ++j) {
-    row->render[idx++] = row->contents[j];
+/**
+ * spanGlyph: Decodes the glyph at index j of a row's text into *cp and points
+ * *at at its bytes. Returns how many bytes it takes.
+ *
+ * A glyph never reaches across the gap. Bytes split by it decode as U+FFFD
+ * one at a time, like all malformed UTF-8, so drawing and cursor math agree.
+ */
+static int spanGlyph(const rowSpans *sp, int j, uint32_t *cp,
+                     const char **at) {
+  const char *s;
+  int len;
+  if (j < sp->head_len) {
+    s = sp->head + j;
+    len = sp->head_len - j;
+  } else {
+    s = sp->tail + (j - sp->head_len);
+    len = sp->tail_len - (j - sp->head_len);
+  }
+  *at = s;
+  if ((unsigned char)*s < 0x80) {
+    *cp = (unsigned char)*s;
+    return 1;
   }
+  return tui_utf8_decode(s, len, cp);
+}
 
-  row->render[idx] = '\0';
-  row->rsize = idx;
+// Screen columns glyph cp takes when it starts at column col.
+static int glyphCols(uint32_t cp, int col) {
+  return cp == '\t' ? TAB_STOP - col % TAB_STOP : tui_char_width(cp);
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-  // Since we're letting them insert the character it can be at the very end of
-  // the row thuse we allow row->size.
-  if (at < 0 || at > row->size) {
-    at = row->size;
+// Frees row at's render, if it has one of its own.
+void editorDropRender(int at) {
+  erow *row = &E.rows[at];
+  rowText *t = &E.text[at];
+  if (row->flags & ROW_INLINE) {
+    // Always aliased, and render overlaps the inline text anyway.
+    return;
   }
+  if (!(row->flags & ROW_RENDER_ALIAS) && t->render != NULL) {
+    E.render_bytes -= t->render->rcap;
+    slabFree(&E.slab, t->render, t->render->rcap);
+  }
+  t->render = NULL;
+  row->flags &= ~ROW_RENDER_ALIAS;
+}
 
-  // Plus 2 because one for the character being inserted and one for the null
-  // termination character at the end of the line.
-  row->contents = realloc(row->contents, row->size + 2);
-
-  // Essentially shift everything after index at by 1 to make space for the
-  // newly inserted character. This is quite inefficient. People generally use
-  // gap buffers for things like this.
-  memmove(&row->contents[at + 1], &row->contents[at], row->size - at + 1);
-  row->contents[at] = c;
-
-  row->size++;
-  editorUpdateRow(row);
+rowSpans editorRowSpans(int at) {
+  erow *row = &E.rows[at];
+  rowText *t = &E.text[at];
+  const char *text;
+  if (row->flags & ROW_MAPPED) {
+    text = t->contents;
+  } else if (row->flags & ROW_INLINE) {
+    text = t->inline_text;
+  } else {
+    rowGap *g = t->gap;
+    return (rowSpans){g->text, g->gap, g->text + g->gap + g->gap_len,
+                      row->size - g->gap};
+  }
+  return (rowSpans){text, row->size, text + row->size, 0};
 }
 
-void editorProcessKeypress() {
-  char c = editorReadKey();
+/**
+ * editorUpdateRow: Rebuilds row at's render and column index from its text.
+ *
+ * Reads both halves of the gap buffer directly. An untouched mapped row of
+ * plain text renders exactly as stored, so it's flagged as aliasing its text
+ * and nothing gets allocated.
+ */
+void editorUpdateRow(int at) {
+  erow *row = &E.rows[at];
+  rowText *t = &E.text[at];
+  rowSpans sp = editorRowSpans(at);
+  row->flags &= ~ROW_RENDER_DIRTY;
+
+  if ((row->flags & (ROW_MAPPED | ROW_INLINE)) &&
+      textIsPlain(sp.head, sp.head_len) && textIsPlain(sp.tail, sp.tail_len)) {
+    editorDropRender(at);
+    row->flags |= ROW_RENDER_ALIAS;
+    return;
+  }
 
-  if (E.mode == NORMAL) {
-    switch (c) {
-    case ARROW_DOWN:
-      if (E.cur_row < E.num_rows - 1)
-        E.cur_row++;
-      if (editorScroll()) {
-        editorRefreshScreen();
-      } else {
-        moveCursorToCurrentPos();
-      }
-      break;
-    case ARROW_UP:
-      if (E.cur_row > 0)
-        E.cur_row--;
-      if (editorScroll()) {
-        editorRefreshScreen();
-      } else {
-        moveCursorToCurrentPos();
-      }
-      break;
-    case ARROW_RIGHT:
-      if (E.num_rows > 0 && E.cur_col < E.rows[E.cur_row].size)
-        E.cur_col++;
-      moveCursorToCurrentPos();
-      break;
-    case ARROW_LEFT:
-      if (E.cur_col > 0)
-        E.cur_col--;
-      moveCursorToCurrentPos();
-      break;
-    case 'i':
-      E.mode = INSERT;
-      break;
-    case CTRL_KEY('q'):
-      exit(0);
-      break;
-    case CTRL_KEY('r'):
-      editorRefreshScreen();
-      break;
-    default:
-      break;
+  int tabs = 0;
+  for (int j = 0; j < sp.head_len; j++) {
+    tabs += sp.head[j] == '\t';
+  }
+  for (int j = 0; j < sp.tail_len; j++) {
+    tabs += sp.tail[j] == '\t';
+  }
+  // Bytes are copied as is apart from tabs, and no glyph takes more columns
+  // than bytes, so this bounds both the render and its column count.
+  int rmax = row->size + tabs * (TAB_STOP - 1);
+  int marks_at = (rmax + 3) & ~3;
+  size_t need = sizeof(rowRender) + marks_at +
+                sizeof(renderMark) * (rmax / RENDER_MARK_COLS + 1);
+  rowRender *render = row->flags & ROW_RENDER_ALIAS ? NULL : t->render;
+  // An edited row keeps reusing its render block as long as the new render
+  // fits its size class. Otherwise it's rebuilt from scratch anyway, so
+  // there's nothing to copy over.
+  if (render == NULL || need > (size_t)render->rcap) {
+    editorDropRender(at);
+    render = slabAlloc(&E.slab, need);
+    if (render == NULL) {
+      die("slabAlloc row render");
     }
+    render->rcap = slabCapacity(need);
+    E.render_bytes += render->rcap;
   }
+  row->flags &= ~ROW_RENDER_ALIAS;
+  render->marks_at = marks_at;
+  renderMark *marks = renderMarks(render);
 
-  else if (E.mode == INSERT) {
-    switch (c) {
-    case '\x1b':
-      E.mode = NORMAL;
-      break;
-    case CTRL_KEY('q'):
-      exit(0);
-      break;
-    case CTRL_KEY('r'):
-      editorRefreshScreen();
-      break;
-    default:
-      if (E.num_rows == 0) {
-        editorAppendRow("", 0);
-      }
-      editorRowInsertChar(&E.rows[E.cur_row], E.cur_col, c);
-      E.cur_col++;
-      editorRefreshScreen();
-      break;
+  int idx = 0;
+  int col = 0; // tab stops go by screen column, not by byte
+  int nmarks = 0;
+  for (int j = 0; j < row->size;) {
+    uint32_t cp;
+    const char *g;
+    int len = spanGlyph(&sp, j, &cp, &g);
+    if (col >= nmarks * RENDER_MARK_COLS) {
+      // Nothing is wider than a tab, no mark gets skipped.
+      marks[nmarks++] = (renderMark){.col = col, .rbyte = idx, .tbyte = j};
+    }
+    int cols = glyphCols(cp, col);
+    if (cp == '\t') {
+      memset(&render->text[idx], ' ', cols);
+      idx += cols;
+    } else {
+      memcpy(&render->text[idx], g, len);
+      idx += len;
     }
+    col += cols;
+    j += len;
   }
-}
 
-int getCursorPosition(int *rows, int *cols) {
-  char buf[32];
-  unsigned int i = 0;
+  render->rsize = idx;
+  render->cols = col;
+  render->nmarks = nmarks;
+  t->render = render;
+}
 
-  if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
-    return -1;
+/**
+ * editorRowRender: Brings row at's render up to date.
+ * Returns it and stores its length in rsize. Valid until the row changes.
+ */
+const char *editorRowRender(int at, int *rsize) {
+  erow *row = &E.rows[at];
+  rowText *t = &E.text[at];
+  if ((row->flags & ROW_RENDER_DIRTY) ||
+      (!(row->flags & ROW_RENDER_ALIAS) && t->render == NULL)) {
+    editorUpdateRow(at);
   }
+  if (row->flags & ROW_RENDER_ALIAS) {
+    *rsize = row->size;
+    return editorRowSpans(at).head;
+  }
+  *rsize = t->render->rsize;
+  return t->render->text;
+}
 
-  while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1) {
-      break;
+/**
+ * editorTrimRenderCache: Drops every render string outside the viewport.
+ *
+ * Called when the cache grows past RENDER_CACHE_MAX. A sweep only happens
+ * after that many bytes of fresh renders, so its cost is spread thin.
+ */
+void editorTrimRenderCache() {
+  int keep_from = E.row_offset;
+  int keep_to = E.row_offset + E.screen_rows;
+
+  for (int i = 0; i < E.num_rows; i++) {
+    if (i >= keep_from && i < keep_to) {
+      continue;
     }
-    if (buf[i] == 'R') {
-      break;
+    if (!(E.rows[i].flags & (ROW_INLINE | ROW_RENDER_ALIAS))) {
+      editorDropRender(i);
     }
-    ++i;
   }
+}
 
-  if (buf[0] != '\x1b' || buf[1] != '[') {
-    return -1;
+/**
+ * editorRowCxToRx: Converts an index into row at's text to a screen column.
+ *
+ * Plain rows map one to one. Otherwise a binary search over the render's
+ * marks finds the last one at or before cx and the walk goes on from there.
+ * An index inside a glyph maps to the column the glyph starts at.
+ */
+int editorRowCxToRx(int at, int cx) {
+  int size = E.rows[at].size;
+  int rsize;
+  editorRowRender(at, &rsize);
+  if (E.rows[at].flags & ROW_RENDER_ALIAS) {
+    return cx;
   }
-
-  // We're tellig sscanf that the buffer will be of type: int followed by a
-  // semicolon followed by an int. And we want the two int values assigned to
-  // rows and cols respectively.
-  if (sscanf(&buf[2], "%d;%d", rows, cols)) {
-    return -1;
+  rowRender *r = E.text[at].render;
+  if (cx >= size) {
+    return r->cols + (cx - size);
   }
 
+  renderMark *marks = renderMarks(r);
+  int lo = 0;
+  int hi = r->nmarks - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (marks[mid].tbyte <= cx) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  rowSpans sp = editorRowSpans(at);
+  int rx = marks[lo].col;
+  for (int j = marks[lo].tbyte; j < cx;) {
+    uint32_t cp;
+    const char *g;
+    int len = spanGlyph(&sp, j, &cp, &g);
+    if (j + len > cx) {
+      break;
+    }
+    rx += glyphCols(cp, rx);
+    j += len;
+  }
+  return rx;
+}
+
+/**
+ * editorRenderSkip: Finds where screen column col starts in row at's render,
+ * for drawing a row scrolled sideways.
+ * Returns the byte offset of the first glyph starting at or after col. A
+ * double width glyph that straddles col can't be drawn in half, pad is set
+ * to the columns it leaves blank instead.
+ */
+int editorRenderSkip(int at, int col, int *pad) {
+  erow *row = &E.rows[at];
+  *pad = 0;
+  if (col == 0) {
+    return 0;
+  }
+  if (row->flags & ROW_RENDER_ALIAS) {
+    return col < row->size ? col : row->size;
+  }
+  rowRender *r = E.text[at].render;
+  if (col >= r->cols) {
+    return r->rsize;
+  }
+
+  renderMark *marks = renderMarks(r);
+  int k = col / RENDER_MARK_COLS;
+  if (k >= r->nmarks) {
+    k = r->nmarks - 1;
+  }
+  // A tab or a wide glyph can push a mark a little past its column.
+  while (k > 0 && marks[k].col > col) {
+    k--;
+  }
+  int c = marks[k].col;
+  int b = marks[k].rbyte;
+  while (b < r->rsize && c < col) {
+    // Tabs are spaces by now, only widths matter.
+    uint32_t cp = (unsigned char)r->text[b];
+    int len = cp < 0x80 ? 1 : tui_utf8_decode(&r->text[b], r->rsize - b, &cp);
+    int w = tui_char_width(cp);
+    if (c + w > col) {
+      *pad = c + w - col;
+    }
+    c += w;
+    b += len;
+  }
+  return b;
+}
+
+/**
+ * editorRowGlyphStart: The index of the first byte of the glyph that byte at
+ * of row r's text belongs to, so the cursor never sits inside a character.
+ */
+int editorRowGlyphStart(int r, int at) {
+  rowSpans sp = editorRowSpans(r);
+  for (int k = 1; k <= 3 && at - k >= 0; k++) {
+    uint32_t cp;
+    const char *g;
+    int len = spanGlyph(&sp, at - k, &cp, &g);
+    if (at - k + len > at) {
+      return at - k;
+    }
+    if (((unsigned char)*g & 0xC0) != 0x80) {
+      break;
+    }
+  }
+  return at;
+}
+
+// The index just past the glyph starting at at in row r's text.
+int editorRowNextGlyph(int r, int at) {
+  if (at >= E.rows[r].size) {
+    return at;
+  }
+  rowSpans sp = editorRowSpans(r);
+  uint32_t cp;
+  const char *g;
+  return at + spanGlyph(&sp, at, &cp, &g);
+}
+
+/**
+ * editorRowMoveGap: Moves the gap so it starts at at.
+ *
+ * Only the bytes between the old and new gap position get shifted, so for
+ * typing (where the gap is already at the cursor) this does nothing.
+ */
+void editorRowMoveGap(rowGap *g, int at) {
+  if (at < g->gap) {
+    // Bytes [at, gap) hop over the gap to sit right before the tail.
+    memmove(&g->text[at + g->gap_len], &g->text[at], g->gap - at);
+  } else if (at > g->gap) {
+    // The first (at - gap) tail bytes hop back over the gap.
+    memmove(&g->text[g->gap], &g->text[g->gap + g->gap_len], at - g->gap);
+  }
+  g->gap = at;
+}
+
+/**
+ * editorRowGrowGap: Makes sure owned row at's gap has room for need bytes.
+ * Returns the row's block, which may have moved.
+ *
+ * The new gap is about as big as the row itself, so reallocs happen
+ * geometrically less often as the row grows. Whatever the slab rounds the
+ * block up to becomes gap too.
+ */
+rowGap *editorRowGrowGap(int at, int need) {
+  int size = E.rows[at].size;
+  rowGap *g = E.text[at].gap;
+  if (g->gap_len >= need) {
+    return g;
+  }
+
+  int new_gap = size > need ? size : need;
+  if (new_gap < ROW_GAP_MIN) {
+    new_gap = ROW_GAP_MIN;
+  }
+
+  int tail = size - g->gap;
+  int old_gap_len = g->gap_len;
+  size_t want = sizeof(rowGap) + size + new_gap;
+  rowGap *new = slabRealloc(&E.slab, g, sizeof(rowGap) + size + old_gap_len,
+                            want);
+  if (new == NULL) {
+    die("slabRealloc row contents");
+  }
+  new_gap = slabCapacity(want) - sizeof(rowGap) - size;
+  // The tail was at the end of the old block, move it to the end of the new
+  // one.
+  memmove(&new->text[new->gap + new_gap], &new->text[new->gap + old_gap_len],
+          tail);
+  new->gap_len = new_gap;
+  E.text[at].gap = new;
+  return new;
+}
+
+/**
+ * editorRowMakeOwned: Copies a mapped or inline row into a gap buffer of its
+ * own so it can be edited. Returns the row's block.
+ *
+ * This is the copy in copy-on-write: rows nobody touches stay as views into
+ * the file mapping forever.
+ */
+rowGap *editorRowMakeOwned(int at) {
+  erow *row = &E.rows[at];
+  rowText *t = &E.text[at];
+  if (!(row->flags & (ROW_MAPPED | ROW_INLINE))) {
+    return t->gap;
+  }
+
+  size_t want = sizeof(rowGap) + row->size + ROW_GAP_MIN;
+  rowGap *g = slabAlloc(&E.slab, want);
+  if (g == NULL) {
+    die("slabAlloc row contents");
+  }
+  memcpy(g->text, editorRowSpans(at).head, row->size);
+  g->gap = row->size;
+  g->gap_len = slabCapacity(want) - sizeof(rowGap) - row->size;
+
+  if (row->flags & (ROW_INLINE | ROW_RENDER_ALIAS)) {
+    // No render of its own (and an inline row's text was sitting there).
+    t->render = NULL;
+  }
+  t->gap = g;
+  row->flags &= ~(ROW_MAPPED | ROW_INLINE | ROW_RENDER_ALIAS);
+  row->flags |= ROW_RENDER_DIRTY;
+  return g;
+}
+
+void editorRowInsertChar(int at_row, int at, int c) {
+  erow *row = &E.rows[at_row];
+  // Since we're letting them insert the character it can be at the very end of
+  // the row thuse we allow row->size.
+  if (at < 0 || at > row->size) {
+    at = row->size;
+  }
+  char ch = c;
+  undoRecord(UNDO_INSERT, at_row, at, &ch, 1);
+
+  editorRowMoveGap(editorRowMakeOwned(at_row), at);
+  rowGap *g = editorRowGrowGap(at_row, 1);
+  g->text[g->gap++] = c;
+  g->gap_len--;
+
+  row->size++;
+  row->flags |= ROW_RENDER_DIRTY;
+  editorDamageRows(at_row, at_row + 1);
+}
+
+// Deletes the character at at, i.e. what backspace does with at = cursor - 1.
+void editorRowDeleteChar(int at_row, int at) {
+  erow *row = &E.rows[at_row];
+  if (at < 0 || at >= row->size) {
+    return;
+  }
+  rowSpans sp = editorRowSpans(at_row);
+  undoRecord(UNDO_DELETE, at_row, at,
+             at < sp.head_len ? &sp.head[at] : &sp.tail[at - sp.head_len], 1);
+
+  rowGap *g = editorRowMakeOwned(at_row);
+  // Put the gap right after the doomed byte, then swallow it.
+  editorRowMoveGap(g, at + 1);
+  g->gap--;
+  g->gap_len++;
+
+  row->size--;
+  row->flags |= ROW_RENDER_DIRTY;
+  editorDamageRows(at_row, at_row + 1);
+}
+
+// Keeps the cursor from hanging past the end of a shorter line after moving
+// up or down. Only looks at the hot row array.
+void editorClampCol() {
+  int size = E.cur_row < E.num_rows ? E.rows[E.cur_row].size : 0;
+  if (E.cur_col > size) {
+    E.cur_col = size;
+  }
+  if (E.cur_col > 0 && E.cur_col < size) {
+    E.cur_col = editorRowGlyphStart(E.cur_row, E.cur_col);
+  }
+}
+
+void editorProcessKeypress(int c) {
+  // Whatever else comes next, an n still waiting for results is off and the
+  // last one's "not found" has been seen.
+  E.search.jump_dir = 0;
+  if (E.search.not_found) {
+    E.search.not_found = 0;
+    E.redraw |= REDRAW_STATUS;
+  }
+  if (E.save.result != 0) {
+    E.save.result = 0;
+    E.redraw |= REDRAW_STATUS;
+  }
+
+  if (E.mode == NORMAL) {
+    switch (c) {
+    case ARROW_DOWN:
+      // At the end of what's loaded so far, wait for the next chunk instead
+      // of stopping there.
+      while (E.cur_row >= E.num_rows - 1 && E.load.active) {
+        editorLoadWait();
+      }
+      if (E.cur_row < E.num_rows - 1)
+        E.cur_row++;
+      editorClampCol();
+      E.redraw |= REDRAW_CURSOR;
+      break;
+    case ARROW_UP:
+      if (E.cur_row > 0)
+        E.cur_row--;
+      editorClampCol();
+      E.redraw |= REDRAW_CURSOR;
+      break;
+    case ARROW_RIGHT:
+      if (E.num_rows > 0 && E.cur_col < E.rows[E.cur_row].size)
+        E.cur_col = editorRowNextGlyph(E.cur_row, E.cur_col);
+      E.redraw |= REDRAW_CURSOR;
+      break;
+    case ARROW_LEFT:
+      if (E.cur_col > 0)
+        E.cur_col = editorRowGlyphStart(E.cur_row, E.cur_col - 1);
+      E.redraw |= REDRAW_CURSOR;
+      break;
+    case 'i':
+      E.mode = INSERT;
+      E.redraw |= REDRAW_STATUS;
+      break;
+    case '/':
+      E.search.prompt = 1;
+      editorSearchSet("", 0);
+      break;
+    case 'n':
+      editorSearchJump(1);
+      break;
+    case 'u':
+      editorUndo();
+      break;
+    case 'U':
+      editorRedo();
+      break;
+    case 'N':
+      editorSearchJump(-1);
+      break;
+    case CTRL_KEY('q'):
+      exit(0);
+      break;
+    case CTRL_KEY('s'):
+      editorSave();
+      break;
+    case CTRL_KEY('r'):
+      tui_invalidate();
+      E.redraw |= REDRAW_ROWS;
+      break;
+#if KILO_HUD
+    case CTRL_KEY('d'):
+      E.hud.visible = !E.hud.visible;
+      E.hud.width = 0;
+      E.redraw |= REDRAW_ROWS;
+      break;
+#endif
+    default:
+      break;
+    }
+  }
+
+  else if (E.mode == INSERT) {
+    switch (c) {
+    case '\x1b':
+      E.mode = NORMAL;
+      E.undo.sealed = 1;
+      E.redraw |= REDRAW_STATUS;
+      break;
+    case CTRL_KEY('q'):
+      exit(0);
+      break;
+    case CTRL_KEY('s'):
+      editorSave();
+      break;
+    case CTRL_KEY('r'):
+      tui_invalidate();
+      E.redraw |= REDRAW_ROWS;
+      break;
+#if KILO_HUD
+    case CTRL_KEY('d'):
+      E.hud.visible = !E.hud.visible;
+      E.hud.width = 0;
+      E.redraw |= REDRAW_ROWS;
+      break;
+#endif
+    case '\r':
+      editorInsertText(E.cur_row, E.cur_col, "\n", 1);
+      break;
+    case 127: // Backspace
+    case CTRL_KEY('h'):
+      if (E.num_rows > 0 && E.cur_col > 0) {
+        // The whole character, not just its last byte.
+        int start = editorRowGlyphStart(E.cur_row, E.cur_col - 1);
+        while (E.cur_col > start) {
+          editorRowDeleteChar(E.cur_row, --E.cur_col);
+        }
+      }
+      break;
+    default:
+      if (c >= TUI_KEY_UP) {
+        // Function keys and friends, nothing to insert.
+        break;
+      }
+      editorEnsureRow();
+      char utf8[4];
+      int len = tui_utf8_encode(c, utf8);
+      for (int i = 0; i < len; i++) {
+        editorRowInsertChar(E.cur_row, E.cur_col++, utf8[i]);
+      }
+      break;
+    }
+  }
+}
+
+int getCursorPosition(int *rows, int *cols) {
+  char buf[32];
+  unsigned int i = 0;
+
+  if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
+    return -1;
+  }
+
+  while (i < sizeof(buf) - 1) {
+    // VTIME is 0, so give the terminal a moment to answer before reading.
+    if (!tui_input_ready(1000) || read(STDIN_FILENO, &buf[i], 1) != 1) {
+      break;
+    }
+    if (buf[i] == 'R') {
+      break;
+    }
+    ++i;
+  }
+  buf[i] = '\0';
+
+  if (i < 2 || buf[0] != '\x1b' || buf[1] != '[') {
+    return -1;
+  }
+
+  // We're tellig sscanf that the buffer will be of type: int followed by a
+  // semicolon followed by an int. And we want the two int values assigned to
+  // rows and cols respectively.
+  if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) {
+    return -1;
+  }
+
+  return 0;
+}
+
+// Where the "\x1b[?<digits and ;>" that buf[end - 1] ends starts, -1 when
+// buf doesn't end in one.
+static int probeReplyStart(const char *buf, int end) {
+  int i = end - 1;
+  while (i > 0 && (isdigit((unsigned char)buf[i - 1]) || buf[i - 1] == ';')) {
+    i--;
+  }
+  if (i < 3 || memcmp(&buf[i - 3], "\x1b[?", 3) != 0) {
+    return -1;
+  }
+  return i - 3;
+}
+
+/**
+ * getSyncOutputSupport: Asks the terminal whether it does synchronized output.
+ *
+ * DECRQM for mode 2026 goes out followed by a primary device attributes
+ * request. Every terminal answers DA1, and its answer comes last, so one that
+ * ignores DECRQM is caught as soon as that arrives instead of on a timeout.
+ * Anything else that comes in meanwhile was typed, and goes to the input as
+ * if tui_read_input() had read it.
+ * Returns 1 if the mode is supported, 0 otherwise.
+ */
+int getSyncOutputSupport() {
+  const char query[] = "\x1b[?2026$p\x1b[c";
+  char buf[128];
+  int len = 0;
+  int da1 = -1; // where the DA1 answer starts, once it's in
+
+  if (write(STDOUT_FILENO, query, sizeof(query) - 1) != sizeof(query) - 1) {
+    return 0;
+  }
+  while (len < (int)sizeof(buf)) {
+    if (!tui_input_ready(SYNC_PROBE_TIMEOUT_MS) ||
+        read(STDIN_FILENO, &buf[len], 1) != 1) {
+      break;
+    }
+    // The DA1 answer is "\x1b[?<attributes>c", a typed 'c' is just a 'c'.
+    if (buf[len++] == 'c' && (da1 = probeReplyStart(buf, len - 1)) != -1) {
+      break;
+    }
+  }
+  int end = da1 != -1 ? da1 : len;
+
+  // DECRPM answers "\x1b[?2026;<Ps>$y". 1 and 2 are set and reset, 3 is
+  // permanently set. 0 (unknown mode) and 4 (permanently reset) mean no.
+  const char rpm_prefix[] = "\x1b[?2026;";
+  int rpm_len = sizeof(rpm_prefix) - 1 + 3;
+  const char *rpm = memmem(buf, end, rpm_prefix, sizeof(rpm_prefix) - 1);
+  int supported = 0;
+  if (rpm != NULL && rpm + rpm_len <= buf + end && rpm[rpm_len - 2] == '$' &&
+      rpm[rpm_len - 1] == 'y') {
+    char ps = rpm[rpm_len - 3];
+    supported = ps >= '1' && ps <= '3';
+  } else {
+    rpm = NULL;
+  }
+
+  // Hand back everything but the two answers.
+  char typed[sizeof(buf)];
+  int typed_len = 0;
+  for (int i = 0; i < end; i++) {
+    if (rpm != NULL && i == rpm - buf) {
+      i += rpm_len - 1;
+      continue;
+    }
+    typed[typed_len++] = buf[i];
+  }
+  tui_push_input(typed, typed_len);
+  return supported;
+}
+
+int getWindowSize(int *rows, int *cols) {
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+    // No ioctl (a serial line, some emulators), ask the terminal where the
+    // bottom right corner is. Only ever needed once, at startup, resizes go
+    // by the TIOCGWINSZ the loop does.
+    if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
+      return -1;
+    }
+    return getCursorPosition(rows, cols);
+  }
+  *cols = ws.ws_col;
+  *rows = ws.ws_row;
+  return 0;
+}
+
+/*** Row Operations ***/
+
+// Grows the row arrays so count more rows fit.
+void editorReserveRows(int count) {
+  if (E.num_rows + count <= E.row_capacity) {
+    return;
+  }
+  int new_capacity = E.row_capacity == 0 ? 16 : E.row_capacity * 2;
+  while (new_capacity < E.num_rows + count) {
+    new_capacity *= 2;
+  }
+  E.rows = realloc(E.rows, sizeof(erow) * new_capacity);
+  E.text = realloc(E.text, sizeof(rowText) * new_capacity);
+  if (E.rows == NULL || E.text == NULL) {
+    die("realloc rows");
+  }
+  E.row_capacity = new_capacity;
+}
+
+/**
+ * editorInsertRows: Opens count zeroed rows at index at, shifting the rest
+ * down. The arrays are grown and shifted once, however many rows go in.
+ */
+void editorInsertRows(int at, int count) {
+  editorReserveRows(count);
+
+  int after = E.num_rows - at;
+  memmove(&E.rows[at + count], &E.rows[at], sizeof(erow) * after);
+  memmove(&E.text[at + count], &E.text[at], sizeof(rowText) * after);
+  memset(&E.rows[at], 0, sizeof(erow) * count);
+  memset(&E.text[at], 0, sizeof(rowText) * count);
+  E.num_rows += count;
+  editorDamageRows(at, DAMAGE_TO_END);
+}
+
+/**
+ * editorRowSetText: Fills the fresh row at with a followed by b, both copied.
+ *
+ * If the whole line fits and has no tabs it goes inline, otherwise it gets a
+ * block with whatever room its size class leaves as gap. Most rows never get
+ * edited, the first insert that needs more opens up a real gap.
+ */
+void editorRowSetText(int at, const char *a, int a_len, const char *b,
+                      int b_len) {
+  erow *row = &E.rows[at];
+  rowText *t = &E.text[at];
+  int len = a_len + b_len;
+  row->size = len;
+
+  if (len <= ROW_INLINE_MAX && textIsPlain(a, a_len) &&
+      textIsPlain(b, b_len)) {
+    memcpy(t->inline_text, a, a_len);
+    if (b_len > 0) {
+      memcpy(&t->inline_text[a_len], b, b_len);
+    }
+    row->flags = ROW_INLINE | ROW_RENDER_ALIAS;
+    return;
+  }
+
+  size_t want = sizeof(rowGap) + len;
+  rowGap *g = slabAlloc(&E.slab, want);
+  if (g == NULL) {
+    die("slabAlloc row contents");
+  }
+  memcpy(g->text, a, a_len);
+  if (b_len > 0) {
+    memcpy(&g->text[a_len], b, b_len);
+  }
+  g->gap = len;
+  g->gap_len = slabCapacity(want) - want;
+  t->gap = g;
+  t->render = NULL;
+  row->flags = ROW_RENDER_DIRTY;
+}
+
+void editorAppendRow(char *s, size_t len) {
+  editorInsertRows(E.num_rows, 1);
+  editorRowSetText(E.num_rows - 1, s, len, NULL, 0);
+}
+
+// Makes sure there's a row to type into. A file that's still loading gets
+// its first lines, only an empty one gets a fresh empty row.
+void editorEnsureRow() {
+  while (E.num_rows == 0 && E.load.active) {
+    editorLoadWait();
+  }
+  if (E.num_rows == 0) {
+    editorAppendRow("", 0);
+  }
+}
+
+// Is c one of the bytes a line can end with? Terminals paste newlines as \r.
+static int isLineBreak(char c) { return c == '\n' || c == '\r'; }
+
+// Length of the line break starting at s, \r\n counts as one.
+static int lineBreakLen(const char *s, const char *end) {
+  return s[0] == '\r' && s + 1 < end && s[1] == '\n' ? 2 : 1;
+}
+
+/**
+ * editorInsertText: Inserts len bytes of text at (row, col), splitting rows at
+ * every line break. This is the bulk path used by paste.
+ *
+ * The first line goes into the row at the insertion point (one gap grow), the
+ * rest become new rows with at most one allocation each, and the row arrays
+ * are shifted once for all of them. What followed the insertion point ends up
+ * after the last pasted line. The cursor is left just after the text.
+ */
+void editorInsertText(int at_row, int at_col, const char *s, int len) {
+  const char *end = s + len;
+
+  editorEnsureRow();
+  if (at_col < 0 || at_col > E.rows[at_row].size) {
+    at_col = E.rows[at_row].size;
+  }
+  // A paste (or a line break) is an undo step of its own, typing on either
+  // side of it doesn't get lumped in.
+  E.undo.sealed = 1;
+  undoRecord(UNDO_INSERT, at_row, at_col, s, len);
+  E.undo.sealed = 1;
+
+  int breaks = 0;
+  for (const char *p = s; p < end; p++) {
+    if (isLineBreak(*p)) {
+      p += lineBreakLen(p, end) - 1;
+      breaks++;
+    }
+  }
+  editorDamageRows(at_row, breaks == 0 ? at_row + 1 : DAMAGE_TO_END);
+
+  const char *first_end = s;
+  while (first_end < end && !isLineBreak(*first_end)) {
+    first_end++;
+  }
+
+  rowGap *g = editorRowMakeOwned(at_row);
+  editorRowMoveGap(g, at_col);
+
+  if (breaks == 0) {
+    g = editorRowGrowGap(at_row, len);
+    memcpy(&g->text[g->gap], s, len);
+    g->gap += len;
+    g->gap_len -= len;
+    E.rows[at_row].size += len;
+    E.rows[at_row].flags |= ROW_RENDER_DIRTY;
+    E.cur_row = at_row;
+    E.cur_col = at_col + len;
+    return;
+  }
+
+  // Everything after the insertion point moves to the end of the last line.
+  // With the gap at at_col it's already contiguous.
+  const char *tail = &g->text[g->gap + g->gap_len];
+  int tail_len = E.rows[at_row].size - g->gap;
+
+  // New rows go in first, the current row is trimmed once its tail is copied.
+  // They end the way the row they were split off did.
+  int crlf = E.rows[at_row].flags & ROW_CRLF;
+  editorInsertRows(at_row + 1, breaks);
+
+  const char *p = first_end + lineBreakLen(first_end, end);
+  for (int i = 1; i <= breaks; i++) {
+    const char *line_end = p;
+    while (line_end < end && !isLineBreak(*line_end)) {
+      line_end++;
+    }
+    int line_len = line_end - p;
+    int extra = i == breaks ? tail_len : 0;
+    editorRowSetText(at_row + i, p, line_len, tail, extra);
+    E.rows[at_row + i].flags |= crlf;
+
+    if (i == breaks) {
+      E.cur_row = at_row + i;
+      E.cur_col = line_len;
+    }
+    p = line_end < end ? line_end + lineBreakLen(line_end, end) : end;
+  }
+
+  // Drop the tail from the original row and append the first pasted line.
+  erow *row = &E.rows[at_row];
+  g->gap_len += tail_len;
+  row->size = at_col;
+  int first_len = first_end - s;
+  g = editorRowGrowGap(at_row, first_len);
+  memcpy(&g->text[g->gap], s, first_len);
+  g->gap += first_len;
+  g->gap_len -= first_len;
+  row->size += first_len;
+  row->flags |= ROW_RENDER_DIRTY;
+}
+
+// Gives back whatever row at owns in the slab, its text and its render.
+static void editorFreeRow(int at) {
+  editorDropRender(at);
+  erow *row = &E.rows[at];
+  if (!(row->flags & (ROW_MAPPED | ROW_INLINE))) {
+    rowGap *g = E.text[at].gap;
+    slabFree(&E.slab, g, sizeof(rowGap) + row->size + g->gap_len);
+  }
+}
+
+/**
+ * editorDeleteRows: Removes count rows starting at at, shifting the rest up.
+ * The arrays are shifted once, however many rows go.
+ */
+void editorDeleteRows(int at, int count) {
+  for (int i = at; i < at + count; i++) {
+    editorFreeRow(i);
+  }
+  int after = E.num_rows - at - count;
+  memmove(&E.rows[at], &E.rows[at + count], sizeof(erow) * after);
+  memmove(&E.text[at], &E.text[at + count], sizeof(rowText) * after);
+  E.num_rows -= count;
+  editorDamageRows(at, DAMAGE_TO_END);
+}
+
+/**
+ * editorDeleteText: Deletes from (at_row, at_col) up to (end_row, end_col),
+ * joining the two rows. The way back from editorInsertText().
+ *
+ * What's left of the first row keeps its block, the end of the last row is
+ * copied onto it once, and the rows in between are released without ever
+ * being looked at.
+ */
+void editorDeleteText(int at_row, int at_col, int end_row, int end_col) {
+  erow *row = &E.rows[at_row];
+  rowGap *g = editorRowMakeOwned(at_row);
+  editorRowMoveGap(g, at_col);
+  row->flags |= ROW_RENDER_DIRTY;
+  editorDamageRows(at_row, at_row + 1);
+
+  if (end_row == at_row) {
+    // The doomed bytes sit right after the gap, it swallows them.
+    g->gap_len += end_col - at_col;
+    row->size -= end_col - at_col;
+    return;
+  }
+
+  // Drop everything after at_col, then bring in the last row's rest.
+  g->gap_len += row->size - at_col;
+  row->size = at_col;
+  rowSpans sp = editorRowSpans(end_row);
+  int rest = E.rows[end_row].size - end_col;
+  g = editorRowGrowGap(at_row, rest);
+  for (int i = end_col; i < end_col + rest;) {
+    int in_head = i < sp.head_len;
+    const char *from = in_head ? &sp.head[i] : &sp.tail[i - sp.head_len];
+    int n = in_head ? sp.head_len - i : end_col + rest - i;
+    memcpy(&g->text[g->gap], from, n);
+    g->gap += n;
+    g->gap_len -= n;
+    i += n;
+  }
+  row->size += rest;
+  // The joined row ends where the last one did.
+  row->flags = (row->flags & ~ROW_CRLF) | (E.rows[end_row].flags & ROW_CRLF);
+  editorDeleteRows(at_row + 1, end_row - at_row);
+}
+
+/*** Undo ***/
+
+void undoFree() {
+  struct undo *u = &E.undo;
+  for (uint32_t i = 0; i < u->num_chunks; i++) {
+    free(u->chunks[i]);
+  }
+  free(u->chunks);
+  free(u->ops);
+  memset(u, 0, sizeof(*u));
+}
+
+/**
+ * undoDropRedo: Forgets the records past done, which a new edit makes
+ * unreachable, and hands their bytes back to the arena.
+ */
+static void undoDropRedo() {
+  struct undo *u = &E.undo;
+  if (u->done == u->count) {
+    return;
+  }
+  const undoOp *first = &u->ops[u->done];
+  while (u->num_chunks > first->chunk + 1) {
+    free(u->chunks[--u->num_chunks]);
+  }
+  u->chunks[first->chunk]->used = first->at;
+  u->count = u->done;
+}
+
+/**
+ * undoReserve: Room for len more bytes at the end of the arena, in a new
+ * chunk if the last one is full. Where they go is left in *chunk and *at.
+ */
+static char *undoReserve(size_t len, uint32_t *chunk, uint32_t *at) {
+  struct undo *u = &E.undo;
+  undoChunk *c = u->num_chunks > 0 ? u->chunks[u->num_chunks - 1] : NULL;
+  if (c == NULL || c->cap - c->used < len) {
+    if (u->num_chunks == u->chunks_cap) {
+      u->chunks_cap = u->chunks_cap ? u->chunks_cap * 2 : 16;
+      u->chunks = realloc(u->chunks, sizeof(undoChunk *) * u->chunks_cap);
+      if (u->chunks == NULL) {
+        die("realloc undo");
+      }
+    }
+    size_t cap = len > UNDO_CHUNK ? len : UNDO_CHUNK;
+    c = malloc(sizeof(undoChunk) + cap);
+    if (c == NULL) {
+      die("malloc undo");
+    }
+    c->cap = cap;
+    c->used = 0;
+    u->chunks[u->num_chunks++] = c;
+  }
+  *chunk = u->num_chunks - 1;
+  *at = c->used;
+  c->used += len;
+  return &c->text[*at];
+}
+
+/**
+ * undoRecord: Journals an edit that's about to happen, len bytes of s
+ * inserted at (row, col) or the single byte s deleted from there.
+ *
+ * A character typed right where the last one went, or a backspace right
+ * before the last one, extends that record rather than adding another, as
+ * long as its bytes are the newest in the arena and still fit the chunk. A
+ * whole run of typing undoes in one go.
+ */
+void undoRecord(int kind, int row, int col, const char *s, int len) {
+  struct undo *u = &E.undo;
+  if (u->replaying || len == 0) {
+    return;
+  }
+  undoDropRedo();
+
+  undoOp *last = u->done > 0 && !u->sealed ? &u->ops[u->done - 1] : NULL;
+  if (last != NULL && last->kind == kind && last->row == row &&
+      (kind == UNDO_INSERT ? col == last->col + last->len
+                           : col + len == last->col)) {
+    undoChunk *c = u->chunks[last->chunk];
+    if (last->at + last->len == c->used && c->cap - c->used >= (size_t)len) {
+      memcpy(&c->text[c->used], s, len);
+      c->used += len;
+      last->len += len;
+      if (kind == UNDO_DELETE) {
+        last->col = col;
+      }
+      return;
+    }
+  }
+
+  if (u->count == u->cap) {
+    u->cap = u->cap ? u->cap * 2 : 64;
+    u->ops = realloc(u->ops, sizeof(undoOp) * u->cap);
+    if (u->ops == NULL) {
+      die("realloc undo");
+    }
+  }
+  undoOp *op = &u->ops[u->count++];
+  op->kind = kind;
+  op->row = row;
+  op->col = col;
+  op->len = len;
+  memcpy(undoReserve(len, &op->chunk, &op->at), s, len);
+  u->done = u->count;
+  u->sealed = 0;
+}
+
+// Where an insert's text ended up: the row and column right after it.
+static void undoInsertEnd(const undoOp *op, const char *text, int *end_row,
+                          int *end_col) {
+  const char *end = text + op->len;
+  int row = op->row;
+  int col = op->col;
+  for (const char *p = text; p < end; p++) {
+    if (isLineBreak(*p)) {
+      p += lineBreakLen(p, end) - 1;
+      row++;
+      col = 0;
+    } else {
+      col++;
+    }
+  }
+  *end_row = row;
+  *end_col = col;
+}
+
+// Puts a delete record's bytes back, turning them around on the way.
+static void undoRestoreDeleted(const undoOp *op, const char *text) {
+  erow *row = &E.rows[op->row];
+  editorRowMoveGap(editorRowMakeOwned(op->row), op->col);
+  rowGap *g = editorRowGrowGap(op->row, op->len);
+  for (int i = 0; i < op->len; i++) {
+    g->text[g->gap++] = text[op->len - 1 - i];
+  }
+  g->gap_len -= op->len;
+  row->size += op->len;
+  row->flags |= ROW_RENDER_DIRTY;
+  editorDamageRows(op->row, op->row + 1);
+}
+
+/**
+ * editorUndo: Takes back the last journaled edit and puts the cursor where
+ * it was made. The edit's bytes are walked once, however many lines they
+ * span.
+ */
+void editorUndo() {
+  struct undo *u = &E.undo;
+  if (u->done == 0) {
+    return;
+  }
+  const undoOp *op = &u->ops[--u->done];
+  const char *text = &u->chunks[op->chunk]->text[op->at];
+  u->replaying = 1;
+  if (op->kind == UNDO_INSERT) {
+    int end_row, end_col;
+    undoInsertEnd(op, text, &end_row, &end_col);
+    editorDeleteText(op->row, op->col, end_row, end_col);
+  } else {
+    undoRestoreDeleted(op, text);
+  }
+  u->replaying = 0;
+  u->sealed = 1;
+  E.cur_row = op->row;
+  E.cur_col = op->col;
+  E.redraw |= REDRAW_CURSOR;
+}
+
+// Applies the last undone edit again.
+void editorRedo() {
+  struct undo *u = &E.undo;
+  if (u->done == u->count) {
+    return;
+  }
+  const undoOp *op = &u->ops[u->done++];
+  const char *text = &u->chunks[op->chunk]->text[op->at];
+  u->replaying = 1;
+  if (op->kind == UNDO_INSERT) {
+    // Leaves the cursor after the text.
+    editorInsertText(op->row, op->col, text, op->len);
+  } else {
+    editorDeleteText(op->row, op->col, op->row, op->col + op->len);
+    E.cur_row = op->row;
+    E.cur_col = op->col;
+  }
+  u->replaying = 0;
+  u->sealed = 1;
+  E.redraw |= REDRAW_CURSOR;
+}
+
+/*** Line Index ***/
+
+// Makes sure another n offsets fit without checking on every push. Returns
+// -1 when out of memory. No die() here, scans also run on the loader thread.
+static int lineIndexReserve(lineIndex *idx, size_t n) {
+  if (idx->count + n <= idx->cap) {
+    return 0;
+  }
+  size_t cap = idx->cap == 0 ? 1024 : idx->cap;
+  while (cap < idx->count + n) {
+    cap *= 2;
+  }
+  size_t *nl = realloc(idx->nl, sizeof(size_t) * cap);
+  if (nl == NULL) {
+    return -1;
+  }
+  idx->nl = nl;
+  idx->cap = cap;
+  return 0;
+}
+
+/**
+ * lineIndexPushMask: Pushes at + i for every set bit i of mask, lowest first.
+ * The caller has reserved 64 slots.
+ *
+ * A 64 byte block of text mostly holds zero to three line breaks, and a loop
+ * that runs that many times mispredicts all the time. So the first four slots
+ * are always written (the extra ones get overwritten by the next block) and
+ * only blocks with more than that loop.
+ */
+static inline void lineIndexPushMask(lineIndex *idx, uint64_t mask,
+                                     size_t at) {
+  int n = __builtin_popcountll(mask);
+  size_t *out = &idx->nl[idx->count];
+  for (int k = 0; k < 4; k++) {
+    // Bit 63 keeps ctz defined once mask runs out, the slot is junk then.
+    out[k] = at + __builtin_ctzll(mask | (1ULL << 63));
+    mask &= mask - 1;
+  }
+  for (int k = 4; k < n; k++) {
+    out[k] = at + __builtin_ctzll(mask);
+    mask &= mask - 1;
+  }
+  idx->count += n;
+}
+
+/**
+ * The vector scanners below all do the same thing: compare 64 bytes at a time
+ * against '\n', squash the result into a 64 bit mask and push one offset per
+ * set bit. They return how many bytes they covered, always a multiple of 64,
+ * and leave the rest for the scalar loop (which runs into the same allocation
+ * failure if they stopped early).
+ */
+#if defined(__x86_64__) || defined(__i386__)
+static size_t scanSse2(lineIndex *idx, const char *buf, size_t len,
+                       size_t base) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    uint64_t mask = 0;
+    for (int k = 0; k < 4; k++) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(buf + i + 16 * k));
+      uint64_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+      mask |= m << (16 * k);
+    }
+    if (lineIndexReserve(idx, 64) == -1) {
+      break;
+    }
+    lineIndexPushMask(idx, mask, base + i);
+  }
+  return i;
+}
+
+__attribute__((target("avx2,popcnt,bmi"))) static size_t
+scanAvx2(lineIndex *idx, const char *buf, size_t len, size_t base) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    __m256i lo = _mm256_loadu_si256((const __m256i *)(buf + i));
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(buf + i + 32));
+    uint64_t mask =
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl)) |
+        (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl))
+            << 32;
+    if (lineIndexReserve(idx, 64) == -1) {
+      break;
+    }
+    lineIndexPushMask(idx, mask, base + i);
+  }
+  return i;
+}
+#elif defined(__aarch64__)
+static size_t scanNeon(lineIndex *idx, const char *buf, size_t len,
+                       size_t base) {
+  const uint8x16_t nl = vdupq_n_u8('\n');
+  // Each byte's bit in its group of 8, pairwise adds then fold 64 bytes of
+  // compare results into one bit per byte (there's no movemask on NEON).
+  const uint8x16_t bits = {1, 2, 4, 8, 16, 32, 64, 128,
+                           1, 2, 4, 8, 16, 32, 64, 128};
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    const uint8_t *p = (const uint8_t *)buf + i;
+    uint8x16_t m0 = vandq_u8(vceqq_u8(vld1q_u8(p), nl), bits);
+    uint8x16_t m1 = vandq_u8(vceqq_u8(vld1q_u8(p + 16), nl), bits);
+    uint8x16_t m2 = vandq_u8(vceqq_u8(vld1q_u8(p + 32), nl), bits);
+    uint8x16_t m3 = vandq_u8(vceqq_u8(vld1q_u8(p + 48), nl), bits);
+    uint8x16_t sum = vpaddq_u8(vpaddq_u8(m0, m1), vpaddq_u8(m2, m3));
+    sum = vpaddq_u8(sum, sum);
+    uint64_t mask = vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
+    if (lineIndexReserve(idx, 64) == -1) {
+      break;
+    }
+    lineIndexPushMask(idx, mask, base + i);
+  }
+  return i;
+}
+#endif
+
+/**
+ * lineIndexScan: Appends base + i for every '\n' at buf[i] to idx.
+ *
+ * One pass over the text with the widest compare the CPU has (AVX2 when it's
+ * there at runtime, else SSE2 or NEON, else memchr), so on big files this is
+ * about as fast as the memory can be read.
+ * Returns 0, or -1 if idx couldn't grow.
+ */
+int lineIndexScan(lineIndex *idx, const char *buf, size_t len, size_t base) {
+  size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) {
+    done = scanAvx2(idx, buf, len, base);
+  } else {
+    done = scanSse2(idx, buf, len, base);
+  }
+#elif defined(__aarch64__)
+  done = scanNeon(idx, buf, len, base);
+#endif
+
+  const char *p = buf + done;
+  const char *end = buf + len;
+  while ((p = memchr(p, '\n', end - p)) != NULL) {
+    if (lineIndexReserve(idx, 1) == -1) {
+      return -1;
+    }
+    idx->nl[idx->count++] = base + (p - buf);
+    p++;
+  }
+  return 0;
+}
+
+// One thread's share of lineIndexScanParallel().
+struct scanSlice {
+  pthread_t thread;
+  const char *buf;
+  size_t len;
+  size_t base;
+  lineIndex idx;
+  int status;
+};
+
+static void *scanSliceRun(void *arg) {
+  struct scanSlice *slice = arg;
+  slice->status = lineIndexScan(&slice->idx, slice->buf, slice->len,
+                                slice->base);
+  return NULL;
+}
+
+/**
+ * lineIndexScanParallel: lineIndexScan() with buf split into nthreads slices,
+ * each scanned on its own thread (the calling thread takes the first one).
+ *
+ * Every slice gets its own index, so the threads share nothing while they
+ * run. Afterwards a prefix sum over the slices' line counts gives where each
+ * one's offsets go in idx, and they're copied over in order. A slice whose
+ * thread can't be started is scanned right here instead.
+ * Returns 0 on success, -1 if an allocation failed.
+ */
+int lineIndexScanParallel(lineIndex *idx, const char *buf, size_t len,
+                          size_t base, int nthreads) {
+  if (nthreads <= 1) {
+    return lineIndexScan(idx, buf, len, base);
+  }
+
+  struct scanSlice slices[LOAD_THREADS_MAX];
+  int started[LOAD_THREADS_MAX];
+  size_t per = (len + nthreads - 1) / nthreads;
+  for (int i = 0; i < nthreads; i++) {
+    size_t from = i * per < len ? i * per : len;
+    size_t to = from + per < len ? from + per : len;
+    slices[i] = (struct scanSlice){
+        .buf = buf + from, .len = to - from, .base = base + from};
+    started[i] = i > 0 && pthread_create(&slices[i].thread, NULL, scanSliceRun,
+                                         &slices[i]) == 0;
+  }
+  for (int i = 0; i < nthreads; i++) {
+    if (started[i]) {
+      pthread_join(slices[i].thread, NULL);
+    } else {
+      scanSliceRun(&slices[i]);
+    }
+  }
+
+  size_t at[LOAD_THREADS_MAX];
+  size_t total = 0;
+  int status = 0;
+  for (int i = 0; i < nthreads; i++) {
+    at[i] = idx->count + total;
+    total += slices[i].idx.count;
+    status |= slices[i].status;
+  }
+  if (status == 0 && lineIndexReserve(idx, total) == -1) {
+    status = -1;
+  }
+  for (int i = 0; i < nthreads; i++) {
+    if (status == 0 && slices[i].idx.count > 0) {
+      memcpy(&idx->nl[at[i]], slices[i].idx.nl,
+             sizeof(size_t) * slices[i].idx.count);
+    }
+    free(slices[i].idx.nl);
+  }
+  if (status == 0) {
+    idx->count += total;
+  }
+  return status;
+}
+
+void lineIndexFree(lineIndex *idx) {
+  free(idx->nl);
+  *idx = (lineIndex){0};
+}
+
+/**
+ * editorAppendMappedLines: Appends a row for each line of E.map ending at one
+ * of the count newline offsets in nl, the first line starting at start.
+ * Returns where the line after the last one starts.
+ *
+ * Rows are views into the mapping (nothing is copied) and a \r before the \n
+ * is left out. All rows are added with one grow of the row arrays.
+ */
+size_t editorAppendMappedLines(size_t start, const size_t *nl, size_t count) {
+  // Every field gets written below, so skip the zeroing editorInsertRows()
+  // would do, on a big file that's hundreds of MB of extra stores.
+  editorReserveRows(count);
+  erow *rows = &E.rows[E.num_rows];
+  rowText *texts = &E.text[E.num_rows];
+
+  for (size_t i = 0; i < count; i++) {
+    size_t linelen = nl[i] - start;
+    int flags = ROW_MAPPED;
+    if (linelen > 0 && E.map[nl[i] - 1] == '\r') {
+      linelen--;
+      flags |= ROW_CRLF;
+    }
+    rows[i] = (erow){.size = linelen, .flags = flags};
+    texts[i] = (rowText){.contents = E.map + start, .render = NULL};
+    start = nl[i] + 1;
+  }
+  if (count > 0) {
+    editorDamageRows(E.num_rows, DAMAGE_TO_END);
+  }
+  E.num_rows += count;
+  return start;
+}
+
+// The last line of the mapping, if the file doesn't end with a '\n'.
+void editorAppendMappedTail(size_t start) {
+  size_t end = E.map_size;
+  if (start < end) {
+    editorAppendMappedLines(start, &end, 1);
+    E.no_final_newline = 1;
+  }
+}
+
+/*** Background Load ***/
+
+// How many threads a LOAD_CHUNK_MAX step is scanned with.
+static int editorLoadThreads() {
+  long n = KILO_LOAD_THREADS;
+  if (n <= 0) {
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  return n < 1 ? 1 : n > LOAD_THREADS_MAX ? LOAD_THREADS_MAX : n;
+}
+
+static void *editorLoadWorker(void *arg) {
+  (void)arg;
+  lineIndex chunk_idx = {0};
+  size_t chunk = LOAD_CHUNK_MIN;
+  size_t off = 0;
+  int ok = 1;
+  int threads = editorLoadThreads();
+
+  while (ok && off < E.map_size) {
+    // The small chunks at the start are there to get rows up quickly, once
+    // they're done every core gets a full chunk.
+    int nthreads = chunk == LOAD_CHUNK_MAX ? threads : 1;
+    size_t step = chunk * nthreads;
+    size_t n = E.map_size - off < step ? E.map_size - off : step;
+    chunk_idx.count = 0;
+    ok = lineIndexScanParallel(&chunk_idx, E.map + off, n, off, nthreads) == 0;
+
+    pthread_mutex_lock(&E.load.lock);
+    if (ok && !E.load.stop) {
+      ok = lineIndexReserve(&E.load.pending, chunk_idx.count) == 0;
+    }
+    if (ok && !E.load.stop) {
+      if (chunk_idx.count > 0) {
+        memcpy(&E.load.pending.nl[E.load.pending.count], chunk_idx.nl,
+               sizeof(size_t) * chunk_idx.count);
+      }
+      E.load.pending.count += chunk_idx.count;
+      E.load.scanned = off + n;
+    }
+    E.load.failed = !ok;
+    ok = ok && !E.load.stop;
+    pthread_mutex_unlock(&E.load.lock);
+
+    // A full pipe means a wakeup is pending already.
+    write(E.load.wake[1], "", 1);
+    off += n;
+    if (chunk < LOAD_CHUNK_MAX) {
+      chunk *= 2;
+    }
+  }
+
+  pthread_mutex_lock(&E.load.lock);
+  E.load.done = 1;
+  pthread_mutex_unlock(&E.load.lock);
+  write(E.load.wake[1], "", 1);
+  lineIndexFree(&chunk_idx);
+  return NULL;
+}
+
+/**
+ * editorLoadAbsorb: Turns whatever the worker published since last time into
+ * rows, and wraps the load up once it's done.
+ */
+void editorLoadAbsorb() {
+  char drain[64];
+  while (read(E.load.wake[0], drain, sizeof(drain)) > 0) {
+  }
+
+  pthread_mutex_lock(&E.load.lock);
+  lineIndex got = E.load.pending;
+  E.load.pending = (lineIndex){0};
+  size_t scanned = E.load.scanned;
+  int done = E.load.done;
+  int failed = E.load.failed;
+  pthread_mutex_unlock(&E.load.lock);
+
+  if (failed) {
+    errno = ENOMEM;
+    die("load");
+  }
+
+  // New rows count as damage, which only costs anything while they're on
+  // screen. The progress in the status bar moves either way.
+  E.load.line_start =
+      editorAppendMappedLines(E.load.line_start, got.nl, got.count);
+  lineIndexFree(&got);
+  E.load.progress = scanned;
+
+  if (done) {
+    editorAppendMappedTail(E.load.line_start);
+    madvise(E.map, E.map_size, MADV_NORMAL);
+    editorLoadStop();
+  }
+  E.redraw |= REDRAW_STATUS;
+  // An n that ran off the end of what was loaded goes on with the new rows.
+  editorSearchContinue();
+}
+
+static void editorLoadReady(int fd, int revents, void *data) {
+  (void)fd;
+  (void)revents;
+  (void)data;
+  editorLoadAbsorb();
+}
+
+/**
+ * editorLoadStart: Starts indexing E.map on a worker thread.
+ * Returns 0 on success, -1 if it couldn't be started (the caller then just
+ * indexes the file itself).
+ */
+int editorLoadStart() {
+  struct loader *l = &E.load;
+  if (pipe(l->wake) == -1) {
+    return -1;
+  }
+  for (int i = 0; i < 2; i++) {
+    int flags = fcntl(l->wake[i], F_GETFL);
+    fcntl(l->wake[i], F_SETFL, flags | O_NONBLOCK);
+  }
+  pthread_mutex_init(&l->lock, NULL);
+  l->pending = (lineIndex){0};
+  l->scanned = 0;
+  l->done = 0;
+  l->failed = 0;
+  l->stop = 0;
+  l->line_start = 0;
+  l->progress = 0;
+
+  if (pthread_create(&l->thread, NULL, editorLoadWorker, NULL) != 0) {
+    close(l->wake[0]);
+    close(l->wake[1]);
+    pthread_mutex_destroy(&l->lock);
+    return -1;
+  }
+  l->active = 1;
+  if (tui_watch_fd(l->wake[0], POLLIN, editorLoadReady, NULL) == -1) {
+    editorLoadStop();
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * editorLoadWait: Blocks until the worker publishes its next chunk (or is
+ * done) and takes it in. For when the user heads past what's loaded, so they
+ * wait for one chunk and not the whole file.
+ */
+void editorLoadWait() {
+  struct pollfd pfd = {.fd = E.load.wake[0], .events = POLLIN};
+  while (poll(&pfd, 1, -1) == -1 && errno == EINTR) {
+  }
+  editorLoadAbsorb();
+}
+
+// Waits for a background load to finish completely.
+void editorLoadFinish() {
+  while (E.load.active) {
+    editorLoadWait();
+  }
+}
+
+// Stops the worker if it's still going and releases the loader.
+void editorLoadStop() {
+  struct loader *l = &E.load;
+  if (!l->active) {
+    return;
+  }
+  pthread_mutex_lock(&l->lock);
+  l->stop = 1;
+  pthread_mutex_unlock(&l->lock);
+  pthread_join(l->thread, NULL);
+
+  tui_unwatch_fd(l->wake[0]);
+  close(l->wake[0]);
+  close(l->wake[1]);
+  lineIndexFree(&l->pending);
+  pthread_mutex_destroy(&l->lock);
+  l->active = 0;
+}
+
+/*** Search ***/
+
+// Whether q matches the qlen bytes at p, given the first and the last byte
+// already did.
+static inline int searchVerify(const char *p, const char *q, int qlen) {
+  return qlen <= 2 || memcmp(p + 1, q + 1, qlen - 2) == 0;
+}
+
+/**
+ * The vector filters below test 16 or 32 candidate starts at once: a match
+ * has q's first byte at i and q's last byte at i + qlen - 1, so both get
+ * compared and only starts where both agree go on to a memcmp(). Requiring
+ * two bytes rather than one keeps common first letters from flooding the
+ * verify step. They return the starts they covered and leave the rest to the
+ * scalar loop.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+static size_t searchSse2(lineIndex *idx, const char *buf, size_t starts,
+                         size_t len, size_t base, const char *q, int qlen) {
+  const __m128i first = _mm_set1_epi8(q[0]);
+  const __m128i last = _mm_set1_epi8(q[qlen - 1]);
+  size_t i = 0;
+  for (; i + 16 <= starts && i + qlen - 1 + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(buf + i + qlen - 1));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask != 0) {
+      size_t at = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (searchVerify(buf + at, q, qlen)) {
+        if (lineIndexReserve(idx, 1) == -1) {
+          return i;
+        }
+        idx->nl[idx->count++] = base + at;
+      }
+    }
+  }
+  return i;
+}
+
+__attribute__((target("avx2,bmi"))) static size_t
+searchAvx2(lineIndex *idx, const char *buf, size_t starts, size_t len,
+           size_t base, const char *q, int qlen) {
+  const __m256i first = _mm256_set1_epi8(q[0]);
+  const __m256i last = _mm256_set1_epi8(q[qlen - 1]);
+  size_t i = 0;
+  for (; i + 32 <= starts && i + qlen - 1 + 32 <= len; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i + qlen - 1));
+    unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask != 0) {
+      size_t at = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (searchVerify(buf + at, q, qlen)) {
+        if (lineIndexReserve(idx, 1) == -1) {
+          return i;
+        }
+        idx->nl[idx->count++] = base + at;
+      }
+    }
+  }
+  return i;
+}
+#endif
+
+/**
+ * searchScan: Appends base + i to idx for every match of q starting at
+ * buf[i] with i < starts. Matches may reach up to len bytes into buf, so
+ * consecutive chunks overlap by qlen - 1 and nothing across a chunk border
+ * is missed or found twice.
+ *
+ * AVX2 when the CPU has it, else SSE2. Elsewhere (and for the tail) memchr()
+ * finds the first byte, which libc vectorizes already.
+ * Returns 0, or -1 if idx couldn't grow.
+ */
+int searchScan(lineIndex *idx, const char *buf, size_t starts, size_t len,
+               size_t base, const char *q, int qlen) {
+  if (len < (size_t)qlen) {
+    return 0;
+  }
+  if (starts > len - qlen + 1) {
+    starts = len - qlen + 1;
+  }
+  size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) {
+    i = searchAvx2(idx, buf, starts, len, base, q, qlen);
+  } else {
+    i = searchSse2(idx, buf, starts, len, base, q, qlen);
+  }
+#endif
+  while (i < starts) {
+    const char *p = memchr(buf + i, q[0], starts - i);
+    if (p == NULL) {
+      break;
+    }
+    i = p - buf;
+    if (buf[i + qlen - 1] == q[qlen - 1] && searchVerify(p, q, qlen)) {
+      if (lineIndexReserve(idx, 1) == -1) {
+        return -1;
+      }
+      idx->nl[idx->count++] = base + i;
+    }
+    i++;
+  }
   return 0;
 }
 
-int getWindowSize(int *rows, int *cols) {
-  struct winsize ws;
-  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-    if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
-      return -1;
+static void *editorSearchWorker(void *arg) {
+  (void)arg;
+  struct search *s = &E.search;
+  lineIndex found = {0};
+  size_t off = 0;
+  int ok = 1;
+
+  while (ok && off < E.map_size) {
+    size_t left = E.map_size - off;
+    size_t starts = left < SEARCH_CHUNK ? left : SEARCH_CHUNK;
+    size_t len = starts + s->query_len - 1 < left ? starts + s->query_len - 1
+                                                  : left;
+    found.count = 0;
+    ok = searchScan(&found, E.map + off, starts, len, off, s->query,
+                    s->query_len) == 0;
+
+    pthread_mutex_lock(&s->lock);
+    if (ok && !s->stop) {
+      ok = lineIndexReserve(&s->pending, found.count) == 0;
     }
-    getCursorPosition(rows, cols);
-  } else {
-    *cols = ws.ws_col;
-    *rows = ws.ws_row;
+    if (ok && !s->stop) {
+      if (found.count > 0) {
+        memcpy(&s->pending.nl[s->pending.count], found.nl,
+               sizeof(size_t) * found.count);
+      }
+      s->pending.count += found.count;
+      s->scanned = off + starts;
+    }
+    s->failed = !ok;
+    ok = ok && !s->stop;
+    pthread_mutex_unlock(&s->lock);
+
+    write(s->wake[1], "", 1);
+    off += starts;
+  }
+
+  pthread_mutex_lock(&s->lock);
+  s->done = 1;
+  pthread_mutex_unlock(&s->lock);
+  write(s->wake[1], "", 1);
+  lineIndexFree(&found);
+  return NULL;
+}
+
+/**
+ * editorSearchAbsorb: Takes over the matches the worker published since last
+ * time and picks up a pending n/N with them.
+ *
+ * Rows on screen were searched in place while the worker hadn't reached them,
+ * so they look the same either way and nothing needs a repaint but the
+ * status bar.
+ */
+void editorSearchAbsorb() {
+  struct search *s = &E.search;
+  char drain[64];
+  while (read(s->wake[0], drain, sizeof(drain)) > 0) {
+  }
+
+  pthread_mutex_lock(&s->lock);
+  lineIndex got = s->pending;
+  s->pending = (lineIndex){0};
+  size_t scanned = s->scanned;
+  int done = s->done;
+  int failed = s->failed;
+  pthread_mutex_unlock(&s->lock);
+
+  if (failed) {
+    errno = ENOMEM;
+    die("search");
+  }
+  if (got.count > 0) {
+    if (lineIndexReserve(&s->matches, got.count) == -1) {
+      errno = ENOMEM;
+      die("search");
+    }
+    memcpy(&s->matches.nl[s->matches.count], got.nl,
+           sizeof(size_t) * got.count);
+    s->matches.count += got.count;
+  }
+  lineIndexFree(&got);
+  s->progress = scanned;
+
+  if (done) {
+    s->progress = E.map_size;
+    editorSearchStop();
+  }
+  E.redraw |= REDRAW_STATUS;
+  editorSearchContinue();
+}
+
+static void editorSearchReady(int fd, int revents, void *data) {
+  (void)fd;
+  (void)revents;
+  (void)data;
+  editorSearchAbsorb();
+}
+
+/**
+ * editorSearchStart: Starts looking for E.search.query in E.map on a worker
+ * thread. Without a mapping, or if the thread can't be started, progress
+ * stays 0 and every row is searched in place instead.
+ */
+void editorSearchStart() {
+  struct search *s = &E.search;
+  s->progress = 0;
+  if (E.map == NULL || s->query_len == 0 || pipe(s->wake) == -1) {
+    return;
+  }
+  for (int i = 0; i < 2; i++) {
+    int flags = fcntl(s->wake[i], F_GETFL);
+    fcntl(s->wake[i], F_SETFL, flags | O_NONBLOCK);
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  s->pending = (lineIndex){0};
+  s->scanned = 0;
+  s->done = 0;
+  s->failed = 0;
+  s->stop = 0;
+
+  if (pthread_create(&s->thread, NULL, editorSearchWorker, NULL) != 0) {
+    close(s->wake[0]);
+    close(s->wake[1]);
+    pthread_mutex_destroy(&s->lock);
+    return;
+  }
+  s->active = 1;
+  if (tui_watch_fd(s->wake[0], POLLIN, editorSearchReady, NULL) == -1) {
+    editorSearchStop();
+    s->progress = 0;
+  }
+}
+
+// Stops the worker if it's still going and releases it. The matches it
+// already handed over stay.
+void editorSearchStop() {
+  struct search *s = &E.search;
+  if (!s->active) {
+    return;
+  }
+  pthread_mutex_lock(&s->lock);
+  s->stop = 1;
+  pthread_mutex_unlock(&s->lock);
+  pthread_join(s->thread, NULL);
+
+  tui_unwatch_fd(s->wake[0]);
+  close(s->wake[0]);
+  close(s->wake[1]);
+  lineIndexFree(&s->pending);
+  pthread_mutex_destroy(&s->lock);
+  s->active = 0;
+}
+
+/**
+ * editorSearchSet: Makes q the query. The old search is cancelled, its
+ * matches dropped and a new one started, which is what every keystroke at
+ * the prompt does.
+ */
+void editorSearchSet(const char *q, int len) {
+  struct search *s = &E.search;
+  editorSearchStop();
+  s->matches.count = 0;
+  s->jump_dir = 0;
+  s->not_found = 0;
+  if (len > SEARCH_QUERY_MAX) {
+    len = SEARCH_QUERY_MAX;
+  }
+  memmove(s->query, q, len);
+  s->query_len = len;
+  editorSearchStart();
+  E.redraw |= REDRAW_ROWS;
+}
+
+// Whether row r can go by the match index: still a view into the mapping,
+// and all of it behind the worker.
+static int editorRowIndexed(int r) {
+  if (!(E.rows[r].flags & ROW_MAPPED)) {
     return 0;
   }
+  size_t off = E.text[r].contents - E.map;
+  return off + E.rows[r].size <= E.search.progress;
+}
+
+// Whether row r's matches are still being looked for by the worker, so a
+// jump has to wait for it rather than search the row itself.
+static int editorRowPending(int r) {
+  return E.search.active && (E.rows[r].flags & ROW_MAPPED) &&
+         !editorRowIndexed(r);
+}
+
+// First index into matches at or after off.
+static size_t matchLowerBound(size_t off) {
+  size_t lo = 0;
+  size_t hi = E.search.matches.count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (E.search.matches.nl[mid] < off) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static int spanMatchAt(const rowSpans *sp, int j, const char *q, int qlen) {
+  for (int k = 0; k < qlen; k++) {
+    int at = j + k;
+    char c = at < sp->head_len ? sp->head[at] : sp->tail[at - sp->head_len];
+    if (c != q[k]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * editorRowFind: The first match in row r starting in [from, to) of its text
+ * (the last one if dir < 0), or -1.
+ *
+ * Indexed rows take a binary search over the matches, anything else is
+ * compared in place, across the gap if there is one.
+ */
+int editorRowFind(int r, int from, int to, int dir) {
+  int qlen = E.search.query_len;
+  int size = E.rows[r].size;
+  if (qlen == 0 || size < qlen) {
+    return -1;
+  }
+  if (to > size - qlen + 1) {
+    to = size - qlen + 1;
+  }
+  if (from < 0) {
+    from = 0;
+  }
+  if (from >= to) {
+    return -1;
+  }
+
+  if (editorRowIndexed(r)) {
+    const lineIndex *m = &E.search.matches;
+    size_t off = E.text[r].contents - E.map;
+    if (dir > 0) {
+      size_t k = matchLowerBound(off + from);
+      return k < m->count && m->nl[k] < off + to ? (int)(m->nl[k] - off) : -1;
+    }
+    size_t k = matchLowerBound(off + to);
+    return k > 0 && m->nl[k - 1] >= off + from ? (int)(m->nl[k - 1] - off)
+                                               : -1;
+  }
+
+  rowSpans sp = editorRowSpans(r);
+  if (dir > 0) {
+    for (int j = from; j < to; j++) {
+      if (spanMatchAt(&sp, j, E.search.query, qlen)) {
+        return j;
+      }
+    }
+  } else {
+    for (int j = to - 1; j >= from; j--) {
+      if (spanMatchAt(&sp, j, E.search.query, qlen)) {
+        return j;
+      }
+    }
+  }
   return -1;
-};
+}
 
-/*** Row Operations ***/
-void editorAppendRow(char *s, size_t len) {
-  if (E.num_rows >= E.row_capacity) {
-    int new_capacity = E.row_capacity == 0 ? 16 : E.row_capacity * 2;
-    E.rows = realloc(E.rows, sizeof(erow) * new_capacity);
-    if (E.rows == NULL) {
-      die("realloc rows");
+/**
+ * editorSearchJump: n (dir 1) or N (dir -1), the next match after the cursor
+ * or the last one before it, wrapping around the end of the file.
+ */
+void editorSearchJump(int dir) {
+  struct search *s = &E.search;
+  if (s->query_len == 0 || E.num_rows == 0) {
+    return;
+  }
+  s->not_found = 0;
+  s->jump_dir = dir;
+  s->jump_row = E.cur_row;
+  s->jump_start_row = E.cur_row;
+  s->jump_start_col = E.cur_col;
+  s->jump_wrapped = 0;
+  editorSearchContinue();
+}
+
+/**
+ * editorSearchContinue: Walks rows for a pending jump until it finds a match,
+ * has gone all the way around, or gets to rows without results yet (not
+ * loaded, or not searched by the worker). Then it leaves jump_row there for
+ * the next absorb to carry on from, so no row is looked at twice.
+ */
+void editorSearchContinue() {
+  struct search *s = &E.search;
+  if (s->jump_dir == 0) {
+    return;
+  }
+  for (;;) {
+    int dir = s->jump_dir;
+    int r = s->jump_row;
+    if (r >= E.num_rows || r < 0) {
+      // Going backwards wraps to the end, which isn't known until the file
+      // is loaded. Forwards there may just be more rows on the way.
+      if (E.load.active) {
+        return;
+      }
+      if (s->jump_wrapped) {
+        break;
+      }
+      s->jump_wrapped = 1;
+      s->jump_row = dir > 0 ? 0 : E.num_rows - 1;
+      continue;
+    }
+    if (editorRowPending(r)) {
+      return;
+    }
+
+    int from = 0;
+    int to = E.rows[r].size;
+    int last = 0;
+    if (r == s->jump_start_row) {
+      // The cursor's row is looked at twice: the part past the cursor first,
+      // then after wrapping the rest.
+      int col = s->jump_start_col;
+      if (!s->jump_wrapped) {
+        from = dir > 0 ? col + 1 : 0;
+        to = dir > 0 ? to : col;
+      } else {
+        from = dir > 0 ? 0 : col;
+        to = dir > 0 ? col + 1 : to;
+        last = 1;
+      }
+    } else if (s->jump_wrapped &&
+               (dir > 0 ? r > s->jump_start_row : r < s->jump_start_row)) {
+      break;
+    }
+
+    int cx = editorRowFind(r, from, to, dir);
+    if (cx != -1) {
+      E.cur_row = r;
+      E.cur_col = cx;
+      s->jump_dir = 0;
+      E.redraw |= REDRAW_CURSOR | REDRAW_STATUS;
+      return;
+    }
+    if (last) {
+      break;
+    }
+    s->jump_row += dir;
+  }
+  s->jump_dir = 0;
+  s->not_found = 1;
+  E.redraw |= REDRAW_STATUS;
+}
+
+/**
+ * editorSearchPromptKey: A key typed at the / prompt.
+ *
+ * Every change to the query restarts the search, so matches light up while
+ * it's typed. Enter keeps it and jumps to the next match, Esc throws it away.
+ */
+void editorSearchPromptKey(uint32_t c) {
+  struct search *s = &E.search;
+  if (c == '\r') {
+    s->prompt = 0;
+    E.redraw |= REDRAW_STATUS;
+    editorSearchJump(1);
+  } else if (c == TUI_KEY_ESC) {
+    s->prompt = 0;
+    editorSearchSet("", 0);
+  } else if (c == TUI_KEY_BACKSPACE || c == CTRL_KEY('h')) {
+    if (s->query_len == 0) {
+      s->prompt = 0;
+      E.redraw |= REDRAW_STATUS;
+      return;
+    }
+    // The whole character, not just its last byte.
+    int len = s->query_len - 1;
+    while (len > 0 && ((unsigned char)s->query[len] & 0xC0) == 0x80) {
+      len--;
+    }
+    editorSearchSet(s->query, len);
+  } else if (c >= ' ' && c < TUI_KEY_UP && c != TUI_KEY_BACKSPACE) {
+    char q[SEARCH_QUERY_MAX + 4];
+    int len = tui_utf8_encode(c, q + s->query_len) + s->query_len;
+    if (len <= SEARCH_QUERY_MAX) {
+      memcpy(q, s->query, s->query_len);
+      editorSearchSet(q, len);
+    }
+  }
+}
+
+/*** Save ***/
+
+// Appends a span to the snapshot, folding it into the last one if it picks
+// up right where that one ends.
+static void saveAddSpan(const char *p, size_t len) {
+  struct saver *s = &E.save;
+  if (len == 0) {
+    return;
+  }
+  s->total += len;
+  if (s->iov_count > 0) {
+    struct iovec *last = &s->iov[s->iov_count - 1];
+    if ((const char *)last->iov_base + last->iov_len == p) {
+      last->iov_len += len;
+      return;
+    }
+  }
+  if (s->iov_count == s->iov_cap) {
+    s->iov_cap = s->iov_cap ? s->iov_cap * 2 : 256;
+    s->iov = realloc(s->iov, sizeof(struct iovec) * s->iov_cap);
+    if (s->iov == NULL) {
+      die("realloc save");
+    }
+  }
+  s->iov[s->iov_count++] = (struct iovec){(char *)p, len};
+}
+
+// Copies row at and its line break into the snapshot: \r\n or \n as the
+// line had it, and none after the last line of a file that had none.
+static void saveCopyRow(int at) {
+  struct saver *s = &E.save;
+  int crlf = (E.rows[at].flags & ROW_CRLF) != 0;
+  int last = at == E.num_rows - 1 && E.no_final_newline && !E.load.active;
+  size_t need = E.rows[at].size + crlf + !last;
+  saveChunk *c = s->copies;
+  if (c == NULL || c->cap - c->used < need) {
+    size_t cap = need > SAVE_COPY_CHUNK ? need : SAVE_COPY_CHUNK;
+    c = malloc(sizeof(saveChunk) + cap);
+    if (c == NULL) {
+      die("malloc save");
+    }
+    c->next = s->copies;
+    c->cap = cap;
+    c->used = 0;
+    s->copies = c;
+  }
+  char *p = &c->text[c->used];
+  rowSpans sp = editorRowSpans(at);
+  memcpy(p, sp.head, sp.head_len);
+  memcpy(p + sp.head_len, sp.tail, sp.tail_len);
+  if (crlf) {
+    p[sp.head_len + sp.tail_len] = '\r';
+  }
+  if (!last) {
+    p[need - 1] = '\n';
+  }
+  c->used += need;
+  saveAddSpan(p, need);
+}
+
+/**
+ * editorSaveSnapshot: Describes the buffer as it is now, as spans for the
+ * worker to write.
+ *
+ * A mapped row takes its line break along from the mapping, \r\n or \n as
+ * the file had it, which is what lets a run of them become one span. An
+ * edited row gets the one ROW_CRLF says it had. The last line of a file that
+ * doesn't end in a newline still doesn't, edited or not. While the file is
+ * loading, what the loader hasn't got to goes out as it is.
+ */
+static void editorSaveSnapshot() {
+  for (int i = 0; i < E.num_rows; i++) {
+    if (!(E.rows[i].flags & ROW_MAPPED)) {
+      saveCopyRow(i);
+      continue;
+    }
+    const char *p = E.text[i].contents;
+    const char *end = p + E.rows[i].size;
+    if (i + 1 < E.num_rows && (E.rows[i + 1].flags & ROW_MAPPED) &&
+        E.text[i + 1].contents == end + 1) {
+      // The next line starts right after this one's '\n'. Going by that
+      // instead of looking keeps the snapshot out of the file's pages.
+      end++;
+    } else {
+      const char *map_end = E.map + E.map_size;
+      if (end < map_end && *end == '\r') {
+        end++;
+      }
+      if (end < map_end && *end == '\n') {
+        end++;
+      }
+    }
+    saveAddSpan(p, end - p);
+  }
+  if (E.load.active) {
+    saveAddSpan(E.map + E.load.line_start, E.map_size - E.load.line_start);
+  }
+}
+
+// Frees the snapshot, the temp file is the worker's business.
+static void editorSaveRelease() {
+  struct saver *s = &E.save;
+  while (s->copies != NULL) {
+    saveChunk *next = s->copies->next;
+    free(s->copies);
+    s->copies = next;
+  }
+  free(s->iov);
+  free(s->path);
+  free(s->tmp_path);
+  s->iov = NULL;
+  s->iov_count = 0;
+  s->iov_cap = 0;
+  s->total = 0;
+  s->path = NULL;
+  s->tmp_path = NULL;
+}
+
+// fsyncs the directory path is in, so the rename itself is on disk too.
+static void saveSyncDir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir = slash == NULL ? strdup(".") : strndup(path, slash - path + 1);
+  if (dir == NULL) {
+    return;
+  }
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+/**
+ * editorSaveWorker: Writes the snapshot out SAVE_BATCH bytes per writev,
+ * then fsyncs, closes and renames. Any failure unlinks the temp file, the
+ * target is either the old file or the whole new one, never half of it.
+ */
+static void *editorSaveWorker(void *arg) {
+  (void)arg;
+  struct saver *s = &E.save;
+  size_t i = 0;   // next span to write
+  size_t off = 0; // and how much of it already went out
+  int err = 0;
+
+  while (i < s->iov_count && err == 0) {
+    struct iovec batch[SAVE_IOV_MAX];
+    int n = 0;
+    size_t bytes = 0;
+    for (size_t j = i, o = off;
+         j < s->iov_count && n < SAVE_IOV_MAX && bytes < SAVE_BATCH;
+         j++, o = 0) {
+      size_t len = s->iov[j].iov_len - o;
+      if (len > SAVE_BATCH - bytes) {
+        len = SAVE_BATCH - bytes;
+      }
+      batch[n++] = (struct iovec){(char *)s->iov[j].iov_base + o, len};
+      bytes += len;
+    }
+
+    ssize_t w = writev(s->fd, batch, n);
+    if (w == -1 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      err = w == -1 ? errno : EIO;
+      break;
+    }
+    // A short write just means the next batch starts further back.
+    for (size_t left = w; left > 0;) {
+      size_t rest = s->iov[i].iov_len - off;
+      if (left < rest) {
+        off += left;
+        break;
+      }
+      left -= rest;
+      i++;
+      off = 0;
     }
-    E.row_capacity = new_capacity;
+
+    pthread_mutex_lock(&s->lock);
+    s->written += w;
+    pthread_mutex_unlock(&s->lock);
+    write(s->wake[1], "", 1);
+  }
+
+  if (err == 0 && fsync(s->fd) == -1) {
+    err = errno;
+  }
+  if (close(s->fd) == -1 && err == 0) {
+    err = errno;
+  }
+  if (err == 0 && rename(s->tmp_path, s->path) == -1) {
+    err = errno;
+  }
+  if (err != 0) {
+    unlink(s->tmp_path);
+  } else {
+    saveSyncDir(s->path);
+  }
+
+  pthread_mutex_lock(&s->lock);
+  s->done = 1;
+  s->error = err;
+  pthread_mutex_unlock(&s->lock);
+  write(s->wake[1], "", 1);
+  return NULL;
+}
+
+// Picks up the worker's progress, and its result once it's done.
+void editorSaveAbsorb() {
+  struct saver *s = &E.save;
+  char drain[64];
+  while (read(s->wake[0], drain, sizeof(drain)) > 0) {
   }
 
-  int at = E.num_rows;
-  E.rows[at].size = len;
-  E.rows[at].contents = malloc(len + 1);
-  if (E.rows[at].contents == NULL) {
-    die("malloc row contents");
+  pthread_mutex_lock(&s->lock);
+  s->progress = s->written;
+  int done = s->done;
+  int error = s->error;
+  pthread_mutex_unlock(&s->lock);
+
+  if (done) {
+    s->result = error == 0 ? 1 : -1;
+    s->result_error = error;
+    s->result_bytes = s->total;
+    editorSaveStop();
+  }
+  E.redraw |= REDRAW_STATUS;
+}
+
+static void editorSaveReady(int fd, int revents, void *data) {
+  (void)fd;
+  (void)revents;
+  (void)data;
+  editorSaveAbsorb();
+}
+
+// Fails the save before it got started, errno says why.
+static void editorSaveFailed() {
+  E.save.result = -1;
+  E.save.result_error = errno;
+  editorSaveRelease();
+  E.redraw |= REDRAW_STATUS;
+}
+
+/**
+ * editorSave: Starts writing the buffer to E.filename in the background.
+ * The status bar follows along and says how it went.
+ *
+ * Symlinks are followed, so it's the file they point to that gets replaced,
+ * and the new file gets the old one's permissions.
+ */
+void editorSave() {
+  struct saver *s = &E.save;
+  if (s->active) {
+    return;
+  }
+  s->result = 0;
+  if (E.filename == NULL) {
+    errno = EINVAL;
+    editorSaveFailed();
+    return;
+  }
+  s->path = realpath(E.filename, NULL);
+  if (s->path == NULL && (s->path = strdup(E.filename)) == NULL) {
+    editorSaveFailed();
+    return;
+  }
+  size_t len = strlen(s->path);
+  s->tmp_path = malloc(len + sizeof(".kilo-XXXXXX"));
+  if (s->tmp_path == NULL) {
+    editorSaveFailed();
+    return;
+  }
+  memcpy(s->tmp_path, s->path, len);
+  memcpy(s->tmp_path + len, ".kilo-XXXXXX", sizeof(".kilo-XXXXXX"));
+  s->fd = mkostemp(s->tmp_path, O_CLOEXEC);
+  if (s->fd == -1) {
+    editorSaveFailed();
+    return;
+  }
+  struct stat st;
+  if (stat(s->path, &st) == 0) {
+    fchmod(s->fd, st.st_mode & 07777);
+  }
+  if (pipe(s->wake) == -1) {
+    int saved = errno;
+    close(s->fd);
+    unlink(s->tmp_path);
+    errno = saved;
+    editorSaveFailed();
+    return;
+  }
+  for (int i = 0; i < 2; i++) {
+    int flags = fcntl(s->wake[i], F_GETFL);
+    fcntl(s->wake[i], F_SETFL, flags | O_NONBLOCK);
   }
-  memcpy(E.rows[at].contents, s, len);
-  E.rows[at].contents[len] = '\0';
 
-  E.rows[at].rsize = 0;
-  E.rows[at].render = NULL;
-  editorUpdateRow(&E.rows[at]);
+  editorSaveSnapshot();
+  pthread_mutex_init(&s->lock, NULL);
+  s->written = 0;
+  s->done = 0;
+  s->error = 0;
+  s->progress = 0;
+  if (pthread_create(&s->thread, NULL, editorSaveWorker, NULL) != 0) {
+    close(s->fd);
+    unlink(s->tmp_path);
+    close(s->wake[0]);
+    close(s->wake[1]);
+    pthread_mutex_destroy(&s->lock);
+    errno = EAGAIN;
+    editorSaveFailed();
+    return;
+  }
+  s->active = 1;
+  if (tui_watch_fd(s->wake[0], POLLIN, editorSaveReady, NULL) == -1) {
+    // Nothing to tell us how it went, wait for it here instead.
+    editorSaveStop();
+  }
+  E.redraw |= REDRAW_STATUS;
+}
 
-  E.num_rows++;
+// Waits for the worker to finish the save and releases it.
+void editorSaveStop() {
+  struct saver *s = &E.save;
+  if (!s->active) {
+    return;
+  }
+  pthread_join(s->thread, NULL);
+  if (s->result == 0) {
+    // Joined without going through editorSaveAbsorb().
+    s->result = s->error == 0 ? 1 : -1;
+    s->result_error = s->error;
+    s->result_bytes = s->total;
+  }
+  tui_unwatch_fd(s->wake[0]);
+  close(s->wake[0]);
+  close(s->wake[1]);
+  pthread_mutex_destroy(&s->lock);
+  editorSaveRelease();
+  s->active = 0;
 }
 
 /*** Init ***/
@@ -511,17 +3284,105 @@ void initEditor() {
   E.cur_row = 0;
   E.cur_col = 0;
   E.row_offset = 0;
+  E.col_offset = 0;
   E.mode = NORMAL;
   E.num_rows = 0;
   E.row_capacity = 0;
   E.rows = NULL;
-  if (getWindowSize(&E.screen_rows, &E.screen_cols) == -1) {
+  E.text = NULL;
+  E.map = NULL;
+  E.map_size = 0;
+  E.render_bytes = 0;
+  // The first frame has to draw everything.
+  E.redraw = REDRAW_ROWS;
+  E.last_frame_ns = 0;
+  int rows;
+  if (getWindowSize(&rows, &E.screen_cols) == -1) {
     die("getWindowSize");
   }
+  // The last row is the status bar.
+  E.screen_rows = rows > 0 ? rows - 1 : 0;
+  if (tui_init(rows, E.screen_cols) == -1) {
+    die("tui_init");
+  }
+  if (KILO_SYNC_OUTPUT && getSyncOutputSupport()) {
+    tui_set_sync(1);
+  }
+  if (tui_loop_init() == -1) {
+    die("tui_loop_init");
+  }
+  tui_set_clear_attrs(EDITOR_FG, EDITOR_BG);
+#if KILO_HUD
+  const char *trace = getenv("KILO_TRACE");
+  if (trace != NULL) {
+    E.hud.trace = fopen(trace, "w");
+    if (E.hud.trace == NULL) {
+      die("fopen trace");
+    }
+    fprintf(E.hud.trace,
+            "frame_ns read_ns update_ns draw_ns diff_ns write_ns bytes rows "
+            "allocs\n");
+  }
+#endif
   atexit(editorFree);
 }
 
+/**
+ * editorOpenMapped: Loads a file by mapping it and pointing rows into it.
+ *
+ * No line is copied here, rows are views until someone edits them. Returns -1
+ * when the file can't be mapped (pipes, ttys, ...) so the caller can fall back
+ * to reading it.
+ */
+int editorOpenMapped(char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    die("open");
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size == 0) {
+    // mmap refuses zero length mappings, and there are no rows anyway.
+    close(fd);
+    return 0;
+  }
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file alive on its own.
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  E.map = map;
+  E.map_size = st.st_size;
+
+  // The scan reads the file front to back once, let the kernel read ahead
+  // for it. Afterwards access follows the viewport around.
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  if (st.st_size > LOAD_CHUNK_MIN && editorLoadStart() == 0) {
+    // Rows show up as the worker gets through the file.
+    return 0;
+  }
+  lineIndex idx = {0};
+  if (lineIndexScan(&idx, map, st.st_size, 0) == -1) {
+    die("lineIndexScan");
+  }
+  madvise(map, st.st_size, MADV_NORMAL);
+  editorAppendMappedTail(editorAppendMappedLines(0, idx.nl, idx.count));
+  lineIndexFree(&idx);
+  return 0;
+}
+
 void editorOpen(char *filename) {
+  E.filename = filename;
+  if (editorOpenMapped(filename) == 0) {
+    return;
+  }
+
   FILE *fp = fopen(filename, "r");
   if (!fp) {
     die("fopen");
@@ -531,16 +3392,85 @@ void editorOpen(char *filename) {
   size_t linecap = 0;
   ssize_t linelen;
   while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
+    // The same line breaks the mapped loader knows, \n or \r\n.
+    int flags = 0;
+    E.no_final_newline = line[linelen - 1] != '\n';
+    if (!E.no_final_newline) {
       linelen--;
     }
+    if (linelen > 0 && line[linelen - 1] == '\r') {
+      linelen--;
+      flags = ROW_CRLF;
+    }
     editorAppendRow(line, linelen);
+    E.rows[E.num_rows - 1].flags |= flags;
   }
   free(line);
   fclose(fp);
 }
 
+// Applies a new terminal size and schedules a full redraw.
+void editorResize(int rows, int cols) {
+  E.screen_rows = rows > 0 ? rows - 1 : 0;
+  E.screen_cols = cols;
+  if (tui_resize(rows, cols) == -1) {
+    die("tui_resize");
+  }
+  E.redraw |= REDRAW_ROWS;
+}
+
+// Handles everything the last tui_poll() queued up.
+void editorProcessEvents() {
+  Event ev;
+  while (tui_next_event(&ev)) {
+    if (ev.type == TUI_EVENT_KEY && E.search.prompt) {
+      // Unmapped, arrows mean nothing to the prompt but hjkl are letters.
+      editorSearchPromptKey(ev.key);
+    } else if (ev.type == TUI_EVENT_KEY) {
+      editorProcessKeypress(editorMapKey(&ev));
+    } else if (ev.type == TUI_EVENT_PASTE && E.search.prompt) {
+      // The first line of it goes on the end of the query.
+      char q[SEARCH_QUERY_MAX];
+      int len = E.search.query_len;
+      memcpy(q, E.search.query, len);
+      for (int i = 0; i < ev.paste_len && len < SEARCH_QUERY_MAX; i++) {
+        if (ev.paste[i] == '\n' || ev.paste[i] == '\r') {
+          break;
+        }
+        q[len++] = ev.paste[i];
+      }
+      editorSearchSet(q, len);
+      free(ev.paste);
+    } else if (ev.type == TUI_EVENT_PASTE) {
+      editorInsertText(E.cur_row, E.cur_col, ev.paste, ev.paste_len);
+      free(ev.paste);
+    } else if (ev.type == TUI_EVENT_RESIZE) {
+      editorResize(ev.h, ev.w);
+    }
+  }
+}
+
+/**
+ * editorFrameTimeout: How long the loop may sleep before the next frame.
+ * -1 (forever) when there's nothing to draw, otherwise the time left in the
+ * current frame slot, 0 if a frame is due now.
+ */
+int editorFrameTimeout() {
+  if (E.redraw == 0) {
+    return -1;
+  }
+#if KILO_MAX_FPS == 0
+  return 0;
+#else
+  long long wait_ns =
+      E.last_frame_ns + 1000000000LL / KILO_MAX_FPS - monotonicNs();
+  return wait_ns > 0 ? (wait_ns + 999999) / 1000000 : 0;
+#endif
+}
+
+// kilo-bench and kilo-savecheck link this file too and have the linker hand
+// their own main the start instead (--wrap=main), this one is never called
+// there.
 int main(int argc, char *argv[]) {
   if (argc < 2) {
     fprintf(stderr, "Usage: kilo <filename>\n");
@@ -554,8 +3484,37 @@ int main(int argc, char *argv[]) {
   editorRefreshScreen();
 
   while (1) {
-    editorProcessKeypress();
-  };
+    // Sleeps until input, a resize or the next frame slot.
+    if (tui_poll(editorFrameTimeout()) == -1) {
+      die("poll");
+    }
+    // Fold in everything that's already waiting before drawing, so a paste
+    // or a burst of key repeats turns into a single frame. Stops as soon as
+    // nothing more is waiting, half an escape sequence included, or once a
+    // frame is due: the loader's and the search's wake-ups keep coming for
+    // as long as they run, and must not hold the screen back meanwhile.
+    int more;
+    do {
+#if KILO_HUD
+      long long update_start = monotonicNs();
+      editorProcessEvents();
+      E.hud.pending_update_ns += monotonicNs() - update_start;
+#else
+      editorProcessEvents();
+#endif
+      if (editorFrameTimeout() == 0) {
+        break;
+      }
+      more = tui_poll(0);
+      if (more == -1) {
+        die("poll");
+      }
+    } while (more > 0);
+
+    if (E.redraw != 0 && editorFrameTimeout() == 0) {
+      editorRefreshScreen();
+    }
+  }
 
   return 0;
 }
@@ -0,0 +1,431 @@
+/**
+ * kilo.h: The editor's types and state.
+ *
+ * Shared by kilo.c and the tools that link kilo.o as it is, bench.c to
+ * measure it and savecheck.c to check what it saves, along with the handful
+ * of functions they drive the editor through.
+ * Include it after the feature test macros, like kilo.c does.
+ */
+
+#ifndef KILO_H
+#define KILO_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <termios.h>
+
+#include "tui.h"
+
+/**
+ * Debug HUD: per frame timings for the read, update, draw, diff and write()
+ * phases plus bytes written, rows redrawn and allocator calls, toggled with
+ * Ctrl-D. With KILO_TRACE=<file> in the environment every frame is also
+ * logged to that file. Build with -DKILO_HUD=1, at 0 none of it is compiled.
+ */
+#ifndef KILO_HUD
+#define KILO_HUD 0
+#endif
+
+/**
+ * A freshly loaded row doesn't own its bytes: its text points straight into
+ * the read only file mapping (with no gap). The first edit copies the row out
+ * of the mapping, after which it's a regular gap buffer in the slab.
+ */
+#define ROW_MAPPED (1 << 0)
+
+/**
+ * The render is the row as it appears on screen (tabs expanded). It's built
+ * the first time the row is drawn, not at load time, so it only exists for
+ * rows someone has actually looked at. Edits just flag it dirty.
+ */
+#define ROW_RENDER_DIRTY (1 << 1)
+// The render is the row's own text, nothing is allocated. Only for plain
+// text (ASCII, no tabs, no gap), where a byte is a column.
+#define ROW_RENDER_ALIAS (1 << 2)
+
+/**
+ * Short plain lines that we had to copy anyway (read from a pipe, pasted) are
+ * stored right inside their rowText, no block of their own. They always
+ * render as themselves. Editing one moves it into a gap buffer.
+ */
+#define ROW_INLINE (1 << 3)
+
+// The line ended in \r\n in the file. Rows split off it get the same, so an
+// edited CRLF file is written back as one.
+#define ROW_CRLF (1 << 4)
+
+/**
+ * erow: The hot half of a row, E.rows[i].
+ *
+ * Just what cursor motion, drawing and scans over many rows look at, so those
+ * walk 8 bytes per row of contiguous memory. Where the bytes are is in the
+ * matching E.text[i].
+ */
+typedef struct erow {
+  int size; // bytes of text, the gap isn't counted
+  int flags;
+} erow;
+
+/**
+ * rowGap: An owned row's text, stored as a gap buffer.
+ *
+ * The block holds size + gap_len bytes after this header. The text is
+ * text[0, gap) followed by text[gap + gap_len, size + gap_len), the bytes in
+ * between are free space. Edits move the gap to the cursor (cheap, it's
+ * usually already there) and then insert or delete by just nudging the gap's
+ * edges, so typing is amortized O(1) no matter how long the line is.
+ */
+typedef struct rowGap {
+  int gap;     // index where the gap starts
+  int gap_len; // free bytes sitting at gap
+  char text[];
+} rowGap;
+
+/**
+ * rowRender: An owned render. rcap is the whole block, header included.
+ *
+ * After the text (at marks_at) comes the row's column index: one renderMark
+ * for every RENDER_MARK_COLS screen columns. Mapping a column or a cursor
+ * position starts from the nearest mark and walks at most that many columns
+ * of glyphs, instead of decoding the line from its start.
+ */
+typedef struct rowRender {
+  int rsize;
+  int rcap;
+  int cols;     // screen columns the render takes
+  int nmarks;   // marks[k] is the first glyph at or past column k * 32
+  int marks_at; // offset of the marks into text
+  char text[];
+} rowRender;
+
+#define RENDER_MARK_COLS 32
+
+// Where a glyph starts: its screen column, its byte in the render and its
+// byte in the row's text.
+typedef struct renderMark {
+  int col;
+  int rbyte;
+  int tbyte;
+} renderMark;
+
+/**
+ * rowText: The cold half of a row, E.text[i], which one depends on the flags.
+ *
+ * ROW_MAPPED: contents is a view into E.map. ROW_INLINE: the text itself sits
+ * in inline_text. Otherwise gap is the row's block in the slab. render is
+ * only meaningful without ROW_INLINE and ROW_RENDER_ALIAS.
+ */
+typedef union rowText {
+  struct {
+    union {
+      char *contents;
+      rowGap *gap;
+    };
+    rowRender *render;
+  };
+  char inline_text[2 * sizeof(char *)];
+} rowText;
+
+// We're going vim mode boiz. Maybe not the FULL THING, but at least some
+// semblance of it.
+typedef enum { NORMAL, INSERT, VISUAL } mode;
+
+// We're blaspheming as well. WERE ALIASING hjkl as arrow KEYS
+// :evil_laugh_if_thats_even_an_emote:
+enum editor_key {
+  ARROW_LEFT = 'h',
+  ARROW_RIGHT = 'l',
+  ARROW_UP = 'k',
+  ARROW_DOWN = 'j',
+};
+
+// Background #282828, the text itself uses the terminal's default color.
+#define EDITOR_FG TUI_DEFAULT
+#define EDITOR_BG TUI_RGB(40, 40, 40)
+
+/**
+ * slab: Where row text and render strings live.
+ *
+ * Blocks come in power of two size classes from SLAB_MIN to SLAB_MAX, carved
+ * off SLAB_CHUNK sized chunks with a bump pointer. A freed block goes on the
+ * free list of its class for the next row of that size. Nothing keeps per
+ * block headers, callers pass the capacity back when freeing (rows know it
+ * anyway), so short lines sit next to each other instead of each paying for a
+ * malloc header. Closing the buffer hands back the chunks, not every row.
+ */
+#define SLAB_MIN_SHIFT 4
+#define SLAB_CLASSES 9
+#define SLAB_MIN (1 << SLAB_MIN_SHIFT)
+#define SLAB_MAX (1 << (SLAB_MIN_SHIFT + SLAB_CLASSES - 1))
+#define SLAB_CHUNK (64 << 10)
+
+// Blocks bigger than SLAB_MAX are plain mallocs, linked so they can be
+// released together with the chunks.
+typedef struct slabBig {
+  struct slabBig *prev;
+  struct slabBig *next;
+} slabBig;
+
+struct slab {
+  void *chunks; // each chunk's first bytes point to the next one
+  char *bump;   // unused space in the newest chunk
+  size_t bump_left;
+  void *free[SLAB_CLASSES];
+  slabBig *big;
+};
+
+// Offsets into some text, in order: of every '\n' for the loader, of every
+// match for search.
+typedef struct lineIndex {
+  size_t *nl;
+  size_t count;
+  size_t cap;
+} lineIndex;
+
+/**
+ * loader: Indexes a big file on a worker thread while the UI keeps going.
+ *
+ * The worker scans E.map chunk by chunk, appends the newline offsets it finds
+ * to pending and pokes wake. The UI thread (through a tui_watch_fd callback)
+ * takes pending over and turns it into rows, so only the UI ever touches the
+ * row arrays. The worker only reads the mapping, which nobody writes to.
+ */
+struct loader {
+  int active; // a worker was started and hasn't been joined yet
+  pthread_t thread;
+  int wake[2];
+  pthread_mutex_t lock;
+  // Shared, under lock.
+  lineIndex pending;
+  size_t scanned; // bytes of E.map the worker is through with
+  int done;
+  int failed;
+  int stop;
+  // UI thread only.
+  size_t line_start; // where the next row starts
+  size_t progress;   // scanned, as of the last time we looked
+};
+
+// The longest query the search prompt takes.
+#define SEARCH_QUERY_MAX 256
+
+/**
+ * search: Finds every match of the query in E.map on a worker thread.
+ *
+ * Same arrangement as the loader: the worker only reads the mapping and the
+ * query (which stays put while it runs, a new one means a new worker), hands
+ * match offsets over through pending and pokes wake. The UI appends them to
+ * matches, which is sorted because the worker goes front to back.
+ *
+ * Only rows still mapped, and entirely in the part the worker is through
+ * with, go by matches. Edited rows, rows of a file that isn't mapped and rows
+ * the worker hasn't got to are searched in place when drawn, which is only
+ * ever a screenful.
+ */
+struct search {
+  int active; // a worker was started and hasn't been joined yet
+  pthread_t thread;
+  int wake[2];
+  pthread_mutex_t lock;
+  // Shared, under lock.
+  lineIndex pending; // match offsets, same layout as newline offsets
+  size_t scanned;    // matches starting before this are all in
+  int done;
+  int failed;
+  int stop;
+  // Read by the worker, only changed while there is none.
+  char query[SEARCH_QUERY_MAX];
+  int query_len;
+  // UI thread only.
+  int prompt; // the query is being typed into the status bar
+  int not_found;
+  lineIndex matches;
+  size_t progress; // scanned, as of the last time we looked
+  // An n or N that ran into rows nobody has searched (or loaded) yet, picked
+  // up again from jump_row as results come in. jump_dir is 0 when there's
+  // none.
+  int jump_dir;
+  int jump_row;
+  int jump_start_row;
+  int jump_start_col;
+  int jump_wrapped;
+};
+
+#define UNDO_INSERT 0
+#define UNDO_DELETE 1
+
+/**
+ * undoOp: One record of the undo journal, len bytes inserted or deleted at
+ * (row, col), as the rows were right before the edit.
+ *
+ * The bytes themselves are in the journal's arena. An insert's can span
+ * lines (a paste). A delete's never do, backspace stops at the start of a
+ * row, and they're stored last byte first: the order backspace takes them
+ * in, so a run of backspaces keeps appending to the same record.
+ */
+typedef struct undoOp {
+  int kind;
+  int row;
+  int col;
+  int len;
+  uint32_t chunk; // the arena chunk the bytes are in
+  uint32_t at;    // and where in it
+} undoOp;
+
+typedef struct undoChunk {
+  size_t cap;
+  size_t used;
+  char text[];
+} undoChunk;
+
+/**
+ * undo: The undo journal, an append-only log of what was typed, pasted and
+ * deleted.
+ *
+ * ops[0, done) are applied, ops[done, count) were undone and are what redo
+ * replays until the next edit drops them (and the arena past them). Row
+ * contents are never copied, so the journal grows with the edits and not
+ * with the file, and undoing a paste is one record however big it was.
+ */
+struct undo {
+  undoOp *ops;
+  size_t count;
+  size_t done;
+  size_t cap;
+  // Payloads, appended in order. Chunks are UNDO_CHUNK bytes, a bigger
+  // payload gets one to itself.
+  undoChunk **chunks;
+  uint32_t num_chunks;
+  uint32_t chunks_cap;
+  // The next edit starts a record of its own instead of extending the last
+  // one. Leaving insert mode sets it, so does a paste, undo and redo.
+  int sealed;
+  int replaying; // undo or redo is editing, don't journal that
+};
+
+// Text the saver copied out of edited rows, so typing on can't change it
+// under the worker.
+typedef struct saveChunk {
+  struct saveChunk *next;
+  size_t cap;
+  size_t used;
+  char text[];
+} saveChunk;
+
+/**
+ * saver: Writes the buffer out on a worker thread, into a temp file next to
+ * the target that is fsynced and then renamed over it.
+ *
+ * The UI thread takes a snapshot first, as iovecs. Untouched rows are views
+ * into E.map, and neighbouring ones (newlines included) merge into one span,
+ * so millions of rows cost a handful of iovecs and no copy. Edited rows are
+ * copied, which costs as much as the edits did. The worker only reads the
+ * snapshot, and the mapping outlives the rename since it holds on to the old
+ * file.
+ */
+struct saver {
+  int active; // a worker was started and hasn't been joined yet
+  pthread_t thread;
+  int wake[2];
+  pthread_mutex_t lock;
+  // Shared, under lock.
+  size_t written;
+  int done;
+  int error; // errno of whatever failed, 0 if nothing did
+  // The snapshot and where it goes, left alone while the worker runs.
+  struct iovec *iov;
+  size_t iov_count;
+  size_t iov_cap;
+  saveChunk *copies;
+  size_t total;
+  int fd;
+  char *path;
+  char *tmp_path;
+  // UI thread only.
+  size_t progress; // written, as of the last time we looked
+  // How the last save went, shown until the next key: 1 written, -1 failed.
+  int result;
+  int result_error;
+  size_t result_bytes;
+};
+
+#if KILO_HUD
+struct hud {
+  int visible;
+  int width; // cells the overlay takes up
+  FILE *trace;
+  long long pending_update_ns; // handling events since the last frame
+  long long allocs;            // hud_allocs when the last frame finished
+  // The last frame, which is what the overlay shows.
+  long long frame_ns, read_ns, update_ns, draw_ns, diff_ns, write_ns;
+  int bytes, rows, frame_allocs;
+};
+#endif
+
+/*** Data ***/
+struct editorConfig {
+  int cur_row;
+  int cur_col;
+  int row_offset;
+  int col_offset; // first screen column shown, lines longer than the screen
+  int screen_rows;
+  int screen_cols;
+  struct termios original_termios;
+  mode mode;
+  int num_rows;
+  int row_capacity;
+  erow *rows;
+  rowText *text; // row_capacity entries, like rows
+  // Owns every row's contents and render that doesn't point into map.
+  struct slab slab;
+  char *filename;
+  // The opened file, mapped read only. Rows flagged ROW_MAPPED point into it.
+  char *map;
+  size_t map_size;
+  // The file's last line has no line break, the last row is saved without.
+  int no_final_newline;
+  struct loader load;
+  struct search search;
+  struct undo undo;
+  struct saver save;
+  // Bytes held by owned (non aliased) render strings.
+  size_t render_bytes;
+  // What the next frame has to redo, REDRAW_* bits. Key handlers only set
+  // these, editorRefreshScreen() does the work once per loop iteration.
+  int redraw;
+  // With REDRAW_DAMAGE, the file rows [damage_from, damage_to) that changed.
+  int damage_from;
+  int damage_to;
+  long long last_frame_ns;
+#if KILO_HUD
+  struct hud hud;
+#endif
+};
+
+extern struct editorConfig E;
+
+#define REDRAW_CURSOR (1 << 0) // the cursor moved
+#define REDRAW_ROWS (1 << 1)   // repaint every row
+#define REDRAW_STATUS (1 << 2) // only the status bar changed
+#define REDRAW_DAMAGE (1 << 3) // repaint the rows in E.damage_from..damage_to
+
+long long monotonicNs();
+void die(const char *s);
+void editorOpen(char *filename);
+void editorLoadFinish();
+void editorFree();
+void editorResize(int rows, int cols);
+void editorProcessKeypress(int c);
+void editorSearchSet(const char *q, int len);
+void editorSearchAbsorb();
+void editorDrawRows();
+void editorRefreshScreen();
+void editorInsertText(int at_row, int at_col, const char *s, int len);
+void editorDeleteText(int at_row, int at_col, int end_row, int end_col);
+void editorSave();
+void editorSaveStop();
+
+#endif
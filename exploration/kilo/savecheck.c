@@ -0,0 +1,148 @@
+/**
+ * savecheck.c: Save round-trip check for kilo.
+ *
+ * Links kilo.o and libtui.a like kilo-bench does, with the linker handing the
+ * start to the main below (-Wl,--wrap=main, see the Makefile). Each case
+ * writes a file, opens it, edits it, saves it and compares what ended up on
+ * disk with what should have: line breaks stay what the file had, \r\n or
+ * \n, and a last line without one is saved without.
+ *
+ * Usage: make check
+ */
+
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kilo.h"
+#include "tui.h"
+
+struct edit {
+  int insert; // 1 inserts text at (row, col), 0 deletes up to (end_row, end_col)
+  int row, col;
+  const char *text;
+  int end_row, end_col;
+};
+
+static const struct {
+  const char *name;
+  const char *before;
+  struct edit edits[2];
+  int num_edits;
+  const char *after;
+} cases[] = {
+    {"unedited, no final newline", "a\r\nb", {{0}}, 0, "a\r\nb"},
+    {"last row edited, no final newline",
+     "a\nb",
+     {{1, 1, 1, "X", 0, 0}},
+     1,
+     "a\nbX"},
+    {"last row split, no final newline",
+     "a\nbc",
+     {{1, 1, 1, "\n", 0, 0}},
+     1,
+     "a\nb\nc"},
+    {"last row joined, no final newline",
+     "a\nb",
+     {{0, 0, 1, NULL, 1, 0}},
+     1,
+     "ab"},
+    {"crlf last row edited, no final newline",
+     "a\r\nb",
+     {{1, 1, 0, "X", 0, 0}},
+     1,
+     "a\r\nXb"},
+    {"crlf rows edited",
+     "ab\r\ncd\r\n",
+     {{1, 0, 2, "X", 0, 0}, {1, 1, 0, "Y", 0, 0}},
+     2,
+     "abX\r\nYcd\r\n"},
+    {"crlf row split",
+     "ab\r\ncd\r\n",
+     {{1, 0, 1, "\n", 0, 0}},
+     1,
+     "a\r\nb\r\ncd\r\n"},
+    {"row joined takes the last row's break",
+     "ab\r\ncd\n",
+     {{0, 0, 1, NULL, 1, 1}},
+     1,
+     "ad\n"},
+};
+
+static char path[] = "/tmp/kilo-savecheck-XXXXXX";
+
+// Sets the editor up from scratch on a file holding before.
+static void checkSetup(const char *before) {
+  editorFree();
+  memset(&E, 0, sizeof(E));
+  E.mode = NORMAL;
+  E.screen_rows = 23;
+  E.screen_cols = 80;
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL || fputs(before, fp) == EOF || fclose(fp) == EOF) {
+    die("savecheck: write");
+  }
+  editorOpen(path);
+  editorLoadFinish();
+}
+
+// What's on disk now, NUL terminated. The caller frees it.
+static char *checkRead(size_t *len) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    die("savecheck: read");
+  }
+  char *buf = NULL;
+  size_t cap = 0;
+  *len = getdelim(&buf, &cap, '\0', fp) == -1 ? 0 : strlen(buf);
+  fclose(fp);
+  return buf;
+}
+
+int __wrap_main(void) {
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    die("savecheck: mkstemp");
+  }
+  close(fd);
+  if (tui_init(24, 80) == -1) {
+    die("tui_init");
+  }
+  if (tui_loop_init() == -1) {
+    die("tui_loop_init");
+  }
+
+  int failed = 0;
+  int num_cases = sizeof(cases) / sizeof(cases[0]);
+  for (int i = 0; i < num_cases; i++) {
+    checkSetup(cases[i].before);
+    for (int j = 0; j < cases[i].num_edits; j++) {
+      const struct edit *e = &cases[i].edits[j];
+      if (e->insert) {
+        editorInsertText(e->row, e->col, e->text, strlen(e->text));
+      } else {
+        editorDeleteText(e->row, e->col, e->end_row, e->end_col);
+      }
+    }
+    editorSave();
+    editorSaveStop();
+
+    size_t len;
+    char *got = checkRead(&len);
+    int ok = E.save.result > 0 && len == strlen(cases[i].after) &&
+             memcmp(got, cases[i].after, len) == 0;
+    printf("%s: %s\n", ok ? "ok" : "FAIL", cases[i].name);
+    failed += !ok;
+    free(got);
+  }
+
+  editorFree();
+  unlink(path);
+  printf("%d of %d failed\n", failed, num_cases);
+  return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,207 @@
+/**
+ * commits.c: Columnar commit storage with interned author names.
+ */
+
+#include "commits.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Offsets into the subject arena and the name pool are 32 bits.
+#define COMMITS_ARENA_MAX UINT32_MAX
+
+void commits_free(CommitStore *st) {
+  free(st->hashes);
+  free(st->times);
+  free(st->authors);
+  free(st->subject_at);
+  free(st->subjects);
+  free(st->names);
+  free(st->name_at);
+  free(st->table);
+  memset(st, 0, sizeof(*st));
+}
+
+// Grows *p (of elem sized items, *cap of them) to hold at least need.
+static int growArray(void *p, size_t elem, size_t *cap, size_t need) {
+  if (need <= *cap) {
+    return 0;
+  }
+  size_t n = *cap ? *cap : 1024 / elem + 1;
+  while (n < need) {
+    n *= 2;
+  }
+  void *grown = realloc(*(void **)p, n * elem);
+  if (grown == NULL) {
+    return -1;
+  }
+  *(void **)p = grown;
+  *cap = n;
+  return 0;
+}
+
+// Every column grows together, so count < cap holds for all of them.
+static int growColumns(CommitStore *st) {
+  if (st->count < st->cap) {
+    return 0;
+  }
+  size_t cap = st->cap ? st->cap * 2 : 1024;
+  void *hashes = realloc(st->hashes, cap * sizeof(*st->hashes));
+  if (hashes != NULL) {
+    st->hashes = hashes;
+  }
+  void *times = realloc(st->times, cap * sizeof(*st->times));
+  if (times != NULL) {
+    st->times = times;
+  }
+  void *authors = realloc(st->authors, cap * sizeof(*st->authors));
+  if (authors != NULL) {
+    st->authors = authors;
+  }
+  void *subject_at = realloc(st->subject_at, cap * sizeof(*st->subject_at));
+  if (subject_at != NULL) {
+    st->subject_at = subject_at;
+  }
+  // The ones that did grow just have slack, cap only moves once all did.
+  if (hashes == NULL || times == NULL || authors == NULL ||
+      subject_at == NULL) {
+    return -1;
+  }
+  st->cap = cap;
+  return 0;
+}
+
+/*** Name Pool ***/
+
+// FNV-1a, names are short and this is only ever hit once per commit.
+static uint32_t hashName(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  }
+  return h;
+}
+
+static int rehashNames(CommitStore *st) {
+  uint32_t cap = st->table_cap ? st->table_cap * 2 : 256;
+  uint32_t *table = calloc(cap, sizeof(uint32_t));
+  if (table == NULL) {
+    return -1;
+  }
+  for (uint32_t id = 0; id < st->num_names; id++) {
+    const char *name = &st->names[st->name_at[id]];
+    uint32_t slot = hashName(name, strlen(name)) & (cap - 1);
+    while (table[slot] != 0) {
+      slot = (slot + 1) & (cap - 1);
+    }
+    table[slot] = id + 1;
+  }
+  free(st->table);
+  st->table = table;
+  st->table_cap = cap;
+  return 0;
+}
+
+/**
+ * internName: The id of name, adding it to the pool if it's new.
+ * Returns the id, or -1 if memory ran out.
+ */
+static int64_t internName(CommitStore *st, const char *name, size_t len) {
+  if ((st->num_names + 1) * 2 > st->table_cap && rehashNames(st) == -1) {
+    return -1;
+  }
+  uint32_t mask = st->table_cap - 1;
+  uint32_t slot = hashName(name, len) & mask;
+  while (st->table[slot] != 0) {
+    uint32_t id = st->table[slot] - 1;
+    const char *known = &st->names[st->name_at[id]];
+    if (strncmp(known, name, len) == 0 && known[len] == '\0') {
+      return id;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  if (st->names_len + len + 1 > COMMITS_ARENA_MAX ||
+      growArray(&st->names, 1, &st->names_cap, st->names_len + len + 1) ==
+          -1) {
+    return -1;
+  }
+  size_t slots = st->names_slot_cap;
+  if (growArray(&st->name_at, sizeof(uint32_t), &slots, st->num_names + 1) ==
+      -1) {
+    return -1;
+  }
+  st->names_slot_cap = slots;
+
+  uint32_t id = st->num_names++;
+  st->name_at[id] = st->names_len;
+  memcpy(&st->names[st->names_len], name, len);
+  st->names[st->names_len + len] = '\0';
+  st->names_len += len + 1;
+  st->table[slot] = id + 1;
+  return id;
+}
+
+/*** Commits ***/
+
+static int hexDigit(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+int commits_append(CommitStore *st, const char *hex, const char *author,
+                   size_t author_len, int64_t time, const char *subject,
+                   size_t subject_len) {
+  if (growColumns(st) == -1) {
+    return -1;
+  }
+
+  uint8_t *hash = st->hashes[st->count];
+  for (int i = 0; i < COMMIT_HASH_BYTES; i++) {
+    int hi = hexDigit(hex[2 * i]);
+    int lo = hi < 0 ? -1 : hexDigit(hex[2 * i + 1]);
+    if (lo < 0) {
+      return -1;
+    }
+    hash[i] = hi << 4 | lo;
+  }
+
+  if (st->subjects_len + subject_len + 1 > COMMITS_ARENA_MAX ||
+      growArray(&st->subjects, 1, &st->subjects_cap,
+                st->subjects_len + subject_len + 1) == -1) {
+    return -1;
+  }
+  int64_t id = internName(st, author, author_len);
+  if (id == -1) {
+    return -1;
+  }
+
+  size_t i = st->count++;
+  st->times[i] = time;
+  st->authors[i] = id;
+  st->subject_at[i] = st->subjects_len;
+  memcpy(&st->subjects[st->subjects_len], subject, subject_len);
+  st->subjects[st->subjects_len + subject_len] = '\0';
+  st->subjects_len += subject_len + 1;
+  return 0;
+}
+
+void commits_hash_hex(const CommitStore *st, size_t i, char *out, int n) {
+  static const char digits[] = "0123456789abcdef";
+  const uint8_t *hash = st->hashes[i];
+  if (n > COMMIT_HASH_HEX) {
+    n = COMMIT_HASH_HEX;
+  }
+  for (int d = 0; d < n; d++) {
+    uint8_t b = hash[d / 2];
+    out[d] = digits[d % 2 == 0 ? b >> 4 : b & 0xf];
+  }
+}
@@ -0,0 +1,102 @@
+#ifndef COMMITS_H
+#define COMMITS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*** Commit Store ***/
+
+// SHA-1 object names. Repositories on the SHA-256 object format don't fit.
+#define COMMIT_HASH_BYTES 20
+#define COMMIT_HASH_HEX (COMMIT_HASH_BYTES * 2)
+
+/**
+ * Commits by column rather than by row: a commit is just an index, and each
+ * field lives in its own array. Whoever only needs hash and subject never
+ * pulls authors or dates through the cache, and nothing is a heap string of
+ * its own.
+ *
+ * Authors are interned, an id per distinct name, since the same few hundred
+ * people wrote millions of commits. Subjects go back to back into one arena,
+ * NUL terminated, found through an offset per commit.
+ */
+typedef struct CommitStore {
+  size_t count;
+  size_t cap;
+  uint8_t (*hashes)[COMMIT_HASH_BYTES];
+  int64_t *times;    // author date, seconds since the epoch
+  uint32_t *authors; // ids into the name pool
+  uint32_t *subject_at; // offsets into subjects
+
+  char *subjects;
+  size_t subjects_len;
+  size_t subjects_cap;
+
+  // The name pool: NUL terminated names back to back, name_at[id] is where
+  // id's starts, and an open addressed table (id + 1, 0 for empty) finds the
+  // id of a name.
+  char *names;
+  size_t names_len;
+  size_t names_cap;
+  uint32_t *name_at;
+  uint32_t num_names;
+  uint32_t names_slot_cap; // for name_at
+  uint32_t *table;
+  uint32_t table_cap; // a power of two, kept at least twice num_names
+} CommitStore;
+
+#define COMMIT_STORE_INIT {0}
+
+// Frees every column, the store is empty (and reusable) afterwards.
+void commits_free(CommitStore *st);
+
+/**
+ * commits_append: Adds one commit.
+ * @hex: COMMIT_HASH_HEX hex digits.
+ * Returns 0, or -1 if hex isn't a full object name or memory ran out. Nothing
+ * is added then.
+ */
+int commits_append(CommitStore *st, const char *hex, const char *author,
+                   size_t author_len, int64_t time, const char *subject,
+                   size_t subject_len);
+
+static inline size_t commits_count(const CommitStore *st) { return st->count; }
+
+static inline const uint8_t *commits_hash(const CommitStore *st, size_t i) {
+  return st->hashes[i];
+}
+
+/**
+ * commits_hash_hex: Writes the first n hex digits (at most COMMIT_HASH_HEX)
+ * of commit i's hash into out, no NUL.
+ */
+void commits_hash_hex(const CommitStore *st, size_t i, char *out, int n);
+
+static inline int64_t commits_time(const CommitStore *st, size_t i) {
+  return st->times[i];
+}
+
+static inline uint32_t commits_author_id(const CommitStore *st, size_t i) {
+  return st->authors[i];
+}
+
+static inline const char *commits_name(const CommitStore *st, uint32_t id) {
+  return &st->names[st->name_at[id]];
+}
+
+static inline const char *commits_author(const CommitStore *st, size_t i) {
+  return commits_name(st, st->authors[i]);
+}
+
+// Commit i's subject, NUL terminated, its length in *len if len isn't NULL.
+static inline const char *commits_subject(const CommitStore *st, size_t i,
+                                          size_t *len) {
+  uint32_t at = st->subject_at[i];
+  if (len != NULL) {
+    size_t end = i + 1 < st->count ? st->subject_at[i + 1] : st->subjects_len;
+    *len = end - at - 1;
+  }
+  return &st->subjects[at];
+}
+
+#endif
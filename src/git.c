@@ -0,0 +1,274 @@
+/**
+ * git.c: git log, streamed.
+ *
+ * git runs as a child with its stdout on a pipe. The read end is non-blocking
+ * and sits in the TUI event loop, so every wakeup reads what's there, parses
+ * whole records out of it and hands the new commits to the caller. The first
+ * screenful shows up as soon as git has printed it rather than after the
+ * whole history went through.
+ */
+
+// kill(), pipe2() and friends are hidden behind these when compiling
+// with a strict -std.
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include "git.h"
+#include "tui.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// hash, author, author date, subject. With -z every record ends in a NUL,
+// so each field is exactly one NUL terminated string.
+#define GIT_LOG_FORMAT "--format=%H%x00%an%x00%at%x00%s"
+#define GIT_FIELDS 4
+
+#define GIT_READ_CHUNK (64 << 10)
+// Reads per wakeup, so a fast git can't keep the loop from getting to input.
+#define GIT_READS_PER_WAKEUP 4
+
+/*** Log ***/
+
+struct git_log {
+  pid_t pid; // -1 once reaped
+  int fd;    // read end of git's stdout, -1 once closed
+  int done;
+  int status;
+  git_log_cb cb;
+  void *data;
+
+  CommitStore commits;
+
+  // Bytes read but not parsed yet: the start of a record whose last NUL
+  // hasn't arrived.
+  char *in;
+  size_t in_len;
+  size_t in_cap;
+};
+
+const CommitStore *git_log_commits(const git_log *log) {
+  return &log->commits;
+}
+
+int git_log_done(const git_log *log) { return log->done; }
+
+int git_log_status(const git_log *log) { return log->status; }
+
+/**
+ * logParse: Parses every complete record in the input buffer straight into
+ * the store, then moves the unfinished tail to the front for the next read to
+ * extend. Fields are only looked at in place, a record is copied once, into
+ * its columns.
+ * Returns 0, or -1 if the store ran out of memory or git printed something
+ * that isn't a record.
+ */
+static int logParse(git_log *log) {
+  size_t pos = 0;
+  while (pos < log->in_len) {
+    const char *field[GIT_FIELDS];
+    size_t len[GIT_FIELDS];
+    size_t at = pos;
+    int f = 0;
+    for (; f < GIT_FIELDS; f++) {
+      char *nul = memchr(&log->in[at], '\0', log->in_len - at);
+      if (nul == NULL) {
+        break;
+      }
+      field[f] = &log->in[at];
+      len[f] = nul - field[f];
+      at += len[f] + 1;
+    }
+    if (f < GIT_FIELDS) {
+      break;
+    }
+    if (len[0] != COMMIT_HASH_HEX ||
+        commits_append(&log->commits, field[0], field[1], len[1],
+                       strtoll(field[2], NULL, 10), field[3],
+                       len[3]) == -1) {
+      return -1;
+    }
+    pos = at;
+  }
+  log->in_len -= pos;
+  if (pos > 0 && log->in_len > 0) {
+    memmove(log->in, &log->in[pos], log->in_len);
+  }
+  return 0;
+}
+
+// Closes the pipe and reaps git, blocking if it hasn't exited yet.
+static void logReap(git_log *log) {
+  if (log->fd != -1) {
+    tui_unwatch_fd(log->fd);
+    close(log->fd);
+    log->fd = -1;
+  }
+  if (log->pid > 0) {
+    int st;
+    while (waitpid(log->pid, &st, 0) == -1 && errno == EINTR) {
+    }
+    if (log->status == 0) {
+      log->status = WIFEXITED(st) ? WEXITSTATUS(st) : -1;
+    }
+    log->pid = -1;
+  }
+  log->done = 1;
+}
+
+static void logReadable(int fd, int revents, void *data) {
+  (void)revents;
+  git_log *log = data;
+  size_t before = log->commits.count;
+  int eof = 0;
+
+  for (int r = 0; r < GIT_READS_PER_WAKEUP; r++) {
+    if (log->in_cap - log->in_len < GIT_READ_CHUNK) {
+      size_t cap = log->in_len + GIT_READ_CHUNK;
+      char *in = realloc(log->in, cap);
+      if (in == NULL) {
+        eof = 1;
+        break;
+      }
+      log->in = in;
+      log->in_cap = cap;
+    }
+    ssize_t n = read(fd, &log->in[log->in_len], GIT_READ_CHUNK);
+    if (n > 0) {
+      log->in_len += n;
+      if (n < GIT_READ_CHUNK) {
+        break; // drained, don't spend a read() on EAGAIN
+      }
+      continue;
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && errno == EAGAIN) {
+      break;
+    }
+    eof = 1; // end of output, or a read error
+    break;
+  }
+
+  if (logParse(log) == -1) {
+    // Out of memory, or not a log we can read (a SHA-256 repository). Stop
+    // git rather than keep reading what can't be kept.
+    eof = 1;
+    log->status = -1;
+    kill(log->pid, SIGTERM);
+  }
+  if (eof) {
+    // A record cut short at the end is dropped, git only does that when it
+    // was killed.
+    logReap(log);
+  }
+  // Last, the callback may free the log.
+  if (log->commits.count > before || eof) {
+    log->cb(log, log->data);
+  }
+}
+
+// Forks git log with stdout on a pipe. Returns git's pid and the read end in
+// *fd_out, or -1.
+static pid_t spawnGit(const char *dir, const char *const *args, int *fd_out) {
+  int num_args = 0;
+  while (args != NULL && args[num_args] != NULL) {
+    num_args++;
+  }
+  // git [-C dir] --no-pager log -z --format args... NULL
+  const char **argv = malloc((num_args + 8) * sizeof(char *));
+  if (argv == NULL) {
+    return -1;
+  }
+  int argc = 0;
+  argv[argc++] = "git";
+  if (dir != NULL) {
+    argv[argc++] = "-C";
+    argv[argc++] = dir;
+  }
+  argv[argc++] = "--no-pager";
+  argv[argc++] = "log";
+  argv[argc++] = "-z";
+  argv[argc++] = GIT_LOG_FORMAT;
+  for (int i = 0; i < num_args; i++) {
+    argv[argc++] = args[i];
+  }
+  argv[argc] = NULL;
+
+  int p[2];
+  if (pipe2(p, O_CLOEXEC) == -1) {
+    free(argv);
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    // git's complaints would land on top of the screen, a bad revision shows
+    // up as a non-zero status instead.
+    int null = open("/dev/null", O_RDWR);
+    if (null != -1) {
+      dup2(null, STDIN_FILENO);
+      dup2(null, STDERR_FILENO);
+    }
+    dup2(p[1], STDOUT_FILENO);
+    execvp("git", (char *const *)argv);
+    _exit(127);
+  }
+  free(argv);
+  close(p[1]);
+  if (pid == -1) {
+    close(p[0]);
+    return -1;
+  }
+  fcntl(p[0], F_SETFL, fcntl(p[0], F_GETFL) | O_NONBLOCK);
+  *fd_out = p[0];
+  return pid;
+}
+
+git_log *git_log_start(const char *dir, const char *const *args,
+                       git_log_cb cb, void *data) {
+  git_log *log = calloc(1, sizeof(*log));
+  if (log == NULL) {
+    return NULL;
+  }
+  log->cb = cb;
+  log->data = data;
+  log->fd = -1;
+  log->pid = spawnGit(dir, args, &log->fd);
+  if (log->pid == -1) {
+    free(log);
+    return NULL;
+  }
+  if (tui_watch_fd(log->fd, POLLIN, logReadable, log) == -1) {
+    log->status = -1;
+    git_log_cancel(log);
+    free(log);
+    return NULL;
+  }
+  return log;
+}
+
+void git_log_cancel(git_log *log) {
+  if (log->done) {
+    return;
+  }
+  log->status = -1;
+  kill(log->pid, SIGTERM);
+  logReap(log);
+}
+
+void git_log_free(git_log *log) {
+  if (log == NULL) {
+    return;
+  }
+  git_log_cancel(log);
+  commits_free(&log->commits);
+  free(log->in);
+  free(log);
+}
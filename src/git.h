@@ -0,0 +1,50 @@
+#ifndef GIT_H
+#define GIT_H
+
+#include "commits.h"
+
+/*** Streaming Log ***/
+
+// git log running in the background, read through the TUI event loop.
+typedef struct git_log git_log;
+
+// Called from tui_poll() after new commits were appended, and once more when
+// the stream ends (git_log_done() is set by then). It may git_log_free() the
+// log it was handed.
+typedef void (*git_log_cb)(git_log *log, void *data);
+
+/**
+ * git_log_start: Runs git log in dir (NULL for the current directory) and
+ * streams its output in as it arrives.
+ * @args: Extra git log arguments (revisions, paths, --author=...), NULL
+ * terminated. May be NULL.
+ *
+ * The pipe is non-blocking and watched with tui_watch_fd(), so
+ * tui_loop_init() has to have run. Records come NUL delimited (-z with a
+ * %x00 separated --format) and are parsed as they show up, subjects with tabs
+ * or odd bytes never get split wrong.
+ * Returns the log, or NULL if git couldn't be started.
+ */
+git_log *git_log_start(const char *dir, const char *const *args,
+                       git_log_cb cb, void *data);
+
+/**
+ * git_log_cancel: Stops reading, kills git and reaps it. The commits parsed
+ * so far stay. No more callbacks come after this.
+ */
+void git_log_cancel(git_log *log);
+
+// Cancels if still running and frees everything, the store included.
+void git_log_free(git_log *log);
+
+// Everything parsed so far. Appended to as the log streams in, so pointers
+// into it only hold until the next callback.
+const CommitStore *git_log_commits(const git_log *log);
+
+// Set once git's output has ended, or the log was cancelled.
+int git_log_done(const git_log *log);
+
+// git's exit status once done, -1 if it was cancelled or died on a signal.
+int git_log_status(const git_log *log);
+
+#endif
@@ -1,5 +1,375 @@
+/**
+ * main.c: Commit browser.
+ *
+ * Usage: gitlog [git log arguments...]
+ *
+ * Lists the history of the repository in the current directory, one commit
+ * per row, filling in while git log is still running.
+ */
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include "git.h"
+#include "table.h"
+#include "tui.h"
+
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CTRL_KEY(k) ((k) & 0x1f)
+
+#define LIST_FG TUI_DEFAULT
+#define LIST_BG TUI_DEFAULT
+#define HASH_FG TUI_RGB(0xd7, 0xaf, 0x5f)
+#define DATE_FG TUI_RGB(0x87, 0xaf, 0xd7)
+#define AUTHOR_FG TUI_RGB(0x87, 0xd7, 0x87)
+#define SELECTED_BG TUI_RGB(0x3a, 0x3a, 0x3a)
+#define HEADER_FG TUI_RGB(0xbc, 0xbc, 0xbc)
+#define HEADER_BG TUI_RGB(0x26, 0x26, 0x26)
+#define STATUS_FG TUI_RGB(0x1c, 0x1c, 0x1c)
+#define STATUS_BG TUI_RGB(0xbc, 0xbc, 0xbc)
+
+#define HASH_COLS 7
+
+// Upper bound on frames per second, like kilo's KILO_MAX_FPS. git output and
+// keys arriving faster than this are folded into the next frame. 0 disables
+// the cap.
+#ifndef GITLOG_MAX_FPS
+#define GITLOG_MAX_FPS 120
+#endif
+
+struct app {
+  struct termios original_termios;
+  const char *const *args; // what the log was started with
+  git_log *log;
+  Table table;
+  int rows; // table rows, header included, the status bar takes one more
+  int cols;
+  int redraw;
+  long long last_frame_ns;
+};
+
+static struct app A;
+
+/*** Terminal ***/
+
+// Like quitting, the loop goes down first: stdout back to blocking with the
+// last frame sent in full, no SIGWINCH handler left behind for the shell.
+// Then the screen is cleared in the terminal's own colors for the message.
+static void die(const char *s) {
+  int saved = errno;
+  tui_loop_shutdown();
+  write(STDOUT_FILENO, "\x1b[0m\x1b[2J\x1b[H", 11);
+  errno = saved;
+  perror(s);
+  exit(1);
+}
+
+static void disableRawMode(void) {
+  write(STDOUT_FILENO, "\x1b[0m\x1b[2J\x1b[H", 11);
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &A.original_termios);
+}
+
+// Same raw mode as kilo's, see there for what each flag does.
+static void enableRawMode(void) {
+  if (tcgetattr(STDIN_FILENO, &A.original_termios) == -1) {
+    die("tcgetattr");
+  }
+  atexit(disableRawMode);
+
+  struct termios raw = A.original_termios;
+  raw.c_iflag &= ~(IXON | ICRNL | BRKINT | INPCK | ISTRIP);
+  raw.c_oflag &= ~(OPOST);
+  raw.c_cflag |= (CS8);
+  raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+  raw.c_cc[VMIN] = 0;
+  raw.c_cc[VTIME] = 0;
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+    die("tcsetattr");
+  }
+}
+
+static int getWindowSize(int *rows, int *cols) {
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+    return -1;
+  }
+  *rows = ws.ws_row;
+  *cols = ws.ws_col;
+  return 0;
+}
+
+/*** Log ***/
+
+enum { COL_HASH, COL_DATE, COL_AUTHOR, COL_SUBJECT };
+
+static const TableColumn log_columns[] = {
+    [COL_HASH] = {.title = "Commit", .min_width = HASH_COLS,
+                  .max_width = HASH_COLS},
+    [COL_DATE] = {.title = "Date", .min_width = 10, .max_width = 10},
+    [COL_AUTHOR] = {.title = "Author", .min_width = 8, .max_width = 24,
+                    .percentile = 95},
+    [COL_SUBJECT] = {.title = "Subject", .flex = 1},
+};
+
+// Only the column asked for gets read from the store. The hash and the date
+// are formatted into buffers that hold until the next call, which is as long
+// as the table needs them.
+static void appLogCell(void *data, size_t row, int col, TableCell *cell) {
+  (void)data;
+  const CommitStore *st = git_log_commits(A.log);
+  static char buf[32];
+  switch (col) {
+  case COL_HASH:
+    commits_hash_hex(st, row, buf, HASH_COLS);
+    cell->text = buf;
+    cell->len = HASH_COLS;
+    cell->fg = HASH_FG;
+    break;
+  case COL_DATE: {
+    time_t t = commits_time(st, row);
+    struct tm tm;
+    cell->text = buf;
+    cell->len = strftime(buf, sizeof(buf), "%Y-%m-%d", localtime_r(&t, &tm));
+    cell->fg = DATE_FG;
+    break;
+  }
+  case COL_AUTHOR:
+    cell->text = commits_author(st, row);
+    cell->len = strlen(cell->text);
+    cell->fg = AUTHOR_FG;
+    break;
+  case COL_SUBJECT: {
+    size_t len;
+    cell->text = commits_subject(st, row, &len);
+    cell->len = len;
+    break;
+  }
+  }
+}
+
+// Every batch at least changes the count in the status bar. Rows that were
+// already on screen diff away to nothing, so redrawing is cheap.
+static void appLogUpdate(git_log *log, void *data) {
+  (void)data;
+  table_set_rows(&A.table, commits_count(git_log_commits(log)));
+  A.redraw = 1;
+}
+
+/**
+ * appStartLog: (Re)runs git log with A.args from the top.
+ *
+ * A log that is still streaming gets cancelled first, so asking again never
+ * waits for the previous history to finish.
+ */
+static void appStartLog(void) {
+  git_log_free(A.log);
+  A.log = NULL;
+  table_set_rows(&A.table, 0);
+  A.log = git_log_start(NULL, A.args, appLogUpdate, NULL);
+  if (A.log == NULL) {
+    die("git");
+  }
+  A.redraw = 1;
+}
+
+/*** Drawing ***/
+
+static long long monotonicNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void appDrawStatusBar(void) {
+  int y = A.rows;
+  tui_draw_rect(0, y, A.cols, 1, STATUS_BG);
+
+  char status[80];
+  size_t count = commits_count(git_log_commits(A.log));
+  int len;
+  if (!git_log_done(A.log)) {
+    len = snprintf(status, sizeof(status), " %zu commits, loading...", count);
+  } else if (git_log_status(A.log) != 0) {
+    len = snprintf(status, sizeof(status), " %zu commits, git log failed",
+                   count);
+  } else {
+    len = snprintf(status, sizeof(status), " %zu commits", count);
+  }
+  tui_draw_str(0, y, status, len, STATUS_FG, STATUS_BG);
+
+  if (count > 0) {
+    char pos[32];
+    int pos_len =
+        snprintf(pos, sizeof(pos), "%zu/%zu ", table_selected(&A.table) + 1,
+                 count);
+    tui_draw_str(A.cols - pos_len, y, pos, pos_len, STATUS_FG, STATUS_BG);
+  }
+}
+
+static void appRefreshScreen(void) {
+  tui_clear();
+  table_draw(&A.table);
+  appDrawStatusBar();
+  tui_set_cursor(-1, -1);
+  tui_present();
+  A.redraw = 0;
+  A.last_frame_ns = monotonicNs();
+}
+
+// How long the loop may sleep before the next frame: -1 with nothing to
+// draw, otherwise what's left of the current frame slot, 0 if one is due.
+static int appFrameTimeout(void) {
+  if (!A.redraw) {
+    return -1;
+  }
+#if GITLOG_MAX_FPS == 0
+  return 0;
+#else
+  long long wait_ns =
+      A.last_frame_ns + 1000000000LL / GITLOG_MAX_FPS - monotonicNs();
+  return wait_ns > 0 ? (wait_ns + 999999) / 1000000 : 0;
+#endif
+}
+
+/*** Input ***/
+
+static void appMove(long long delta) {
+  table_move(&A.table, delta);
+  A.redraw = 1;
+}
+
+static void appQuit(void) {
+  // Kills git if it's still going, quitting never waits for the history.
+  git_log_free(A.log);
+  A.log = NULL;
+  tui_loop_shutdown();
+  tui_shutdown();
+  exit(0);
+}
+
+static void appProcessKey(uint32_t key) {
+  switch (key) {
+  case 'q':
+  case CTRL_KEY('q'):
+  case CTRL_KEY('c'):
+    appQuit();
+    break;
+  case 'j':
+  case TUI_KEY_DOWN:
+    appMove(1);
+    break;
+  case 'k':
+  case TUI_KEY_UP:
+    appMove(-1);
+    break;
+  case TUI_KEY_PAGE_DOWN:
+  case CTRL_KEY('d'):
+    appMove(table_body_rows(&A.table));
+    break;
+  case TUI_KEY_PAGE_UP:
+  case CTRL_KEY('u'):
+    appMove(-(long long)table_body_rows(&A.table));
+    break;
+  case 'g':
+  case TUI_KEY_HOME:
+    appMove(-(long long)table_selected(&A.table));
+    break;
+  case 'G':
+  case TUI_KEY_END:
+    appMove(commits_count(git_log_commits(A.log)));
+    break;
+  case 'r':
+    appStartLog();
+    break;
+  }
+}
+
+static void appProcessEvents(void) {
+  Event ev;
+  while (tui_next_event(&ev)) {
+    switch (ev.type) {
+    case TUI_EVENT_KEY:
+      appProcessKey(ev.key);
+      break;
+    case TUI_EVENT_RESIZE:
+      if (tui_resize(ev.h, ev.w) == -1) {
+        die("tui_resize");
+      }
+      A.rows = ev.h - 1;
+      A.cols = ev.w;
+      table_resize(&A.table, 0, 0, A.cols, A.rows);
+      A.redraw = 1;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  (void)argc;
+  A.args = (const char *const *)&argv[1];
+
+  enableRawMode();
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1) {
+    die("getWindowSize");
+  }
+  if (tui_init(rows, cols) == -1) {
+    die("tui_init");
+  }
+  if (tui_loop_init() == -1) {
+    die("tui_loop_init");
+  }
+  A.rows = rows - 1;
+  A.cols = cols;
+  A.table.fg = LIST_FG;
+  A.table.bg = LIST_BG;
+  A.table.selected_bg = SELECTED_BG;
+  A.table.header_fg = HEADER_FG;
+  A.table.header_bg = HEADER_BG;
+  table_set_columns(&A.table, log_columns,
+                    sizeof(log_columns) / sizeof(log_columns[0]), appLogCell,
+                    NULL);
+  table_resize(&A.table, 0, 0, A.cols, A.rows);
+
+  appStartLog();
+  appRefreshScreen();
+
+  while (1) {
+    // Sleeps until input, git output, a resize or the next frame slot.
+    if (tui_poll(appFrameTimeout()) == -1) {
+      die("poll");
+    }
+    // Everything already waiting goes into the same frame, a burst of git
+    // output or key repeats draws once. Half an escape sequence isn't
+    // waiting, the next tui_poll() holds on to it until it's complete. A
+    // big history keeps the pipe readable for as long as git runs, so the
+    // drain also stops once a frame is due.
+    int more;
+    do {
+      appProcessEvents();
+      if (appFrameTimeout() == 0) {
+        break;
+      }
+      more = tui_poll(0);
+      if (more == -1) {
+        die("poll");
+      }
+    } while (more > 0);
+
+    if (A.redraw && appFrameTimeout() == 0) {
+      appRefreshScreen();
+    }
+  }
 
-int main() {
-	return 0;
+  return 0;
 }
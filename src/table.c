@@ -0,0 +1,278 @@
+/**
+ * table.c: Virtualized table with incrementally measured columns.
+ */
+
+#include "table.h"
+
+#include <string.h>
+
+#define TABLE_ELLIPSIS 0x2026
+#define TABLE_SETTLE_ROWS 4096
+
+/*** Text ***/
+
+/**
+ * textFit: How many bytes of s fit in width cells, counted the way
+ * tui_draw_str() lays them out. The cells they take go in *cells.
+ */
+static int textFit(const char *s, int len, int width, int *cells) {
+  int i = 0;
+  int used = 0;
+  while (i < len && used < width) {
+    unsigned char c = s[i];
+    if (c < 0x80) {
+      // ASCII, control characters included, is a cell a byte.
+      i++;
+      used++;
+      continue;
+    }
+    uint32_t cp;
+    int n = tui_utf8_decode(&s[i], len - i, &cp);
+    int w = tui_char_width(cp);
+    if (used + w > width) {
+      break;
+    }
+    i += n;
+    used += w;
+  }
+  // Zero width marks that trail the last glyph still belong to it.
+  while (i < len && (unsigned char)s[i] >= 0x80) {
+    uint32_t cp;
+    int n = tui_utf8_decode(&s[i], len - i, &cp);
+    if (tui_char_width(cp) != 0) {
+      break;
+    }
+    i += n;
+  }
+  *cells = used;
+  return i;
+}
+
+// Draws text into width cells at (x, y), cut short with an ellipsis if it
+// doesn't fit.
+static void drawClipped(int x, int y, int width, const char *s, int len,
+                        tui_color fg, tui_color bg) {
+  if (width <= 0) {
+    return;
+  }
+  int cells;
+  int fit = textFit(s, len, width, &cells);
+  if (fit < len) {
+    fit = textFit(s, len, width - 1, &cells);
+    tui_draw_str(x, y, s, fit, fg, bg);
+    tui_draw_char(x + cells, y, TABLE_ELLIPSIS, fg, bg);
+    return;
+  }
+  tui_draw_str(x, y, s, fit, fg, bg);
+}
+
+/*** Columns ***/
+
+static int columnMeasured(const TableColumn *col) {
+  return !col->flex && col->min_width != col->max_width;
+}
+
+static void resetStats(Table *t) {
+  for (int c = 0; c < t->num_cols; c++) {
+    memset(t->cols[c].hist, 0, sizeof(t->cols[c].hist));
+    t->cols[c].widest = 0;
+  }
+  t->measured = 0;
+  t->layout_dirty = 1;
+}
+
+/**
+ * statWidth: The width percentile percent of the measured rows fit in,
+ * straight from the histogram.
+ */
+static int statWidth(const TableColumn *col, size_t rows) {
+  if (rows == 0) {
+    return 0;
+  }
+  if (col->percentile >= 100) {
+    return col->widest;
+  }
+  size_t want = (rows * col->percentile + 99) / 100;
+  size_t seen = 0;
+  for (int w = 0; w < TABLE_HIST_WIDTHS - 1; w++) {
+    seen += col->hist[w];
+    if (seen >= want) {
+      return w;
+    }
+  }
+  return col->widest;
+}
+
+static void measureRows(Table *t) {
+  for (; t->measured < t->num_rows; t->measured++) {
+    for (int c = 0; c < t->num_cols; c++) {
+      TableColumn *col = &t->cols[c];
+      if (!columnMeasured(col)) {
+        continue;
+      }
+      TableCell cell = {NULL, 0, t->fg};
+      t->cell(t->data, t->measured, c, &cell);
+      // Nothing past the widest a column may get matters, that's where
+      // measuring a long row stops.
+      int limit = col->max_width > TABLE_HIST_WIDTHS ? col->max_width
+                                                     : TABLE_HIST_WIDTHS;
+      int w;
+      textFit(cell.text, cell.len, limit, &w);
+      col->hist[w < TABLE_HIST_WIDTHS ? w : TABLE_HIST_WIDTHS - 1]++;
+      if (w > col->widest) {
+        col->widest = w;
+      }
+    }
+  }
+}
+
+/**
+ * tableLayout: Works out column widths for the current size.
+ *
+ * Fixed columns get their width, measured ones their percentile (or their
+ * title, whichever is wider) within min..max, and the flex column the rest.
+ * If that doesn't fit, measured columns give back space down to their
+ * minimum, rightmost first.
+ */
+static void tableLayout(Table *t) {
+  int avail = t->w - (t->num_cols - 1); // a space between columns
+  int used = 0;
+  int flex = -1;
+  for (int c = 0; c < t->num_cols; c++) {
+    TableColumn *col = &t->cols[c];
+    int w = col->min_width;
+    if (col->flex) {
+      flex = c;
+    } else if (columnMeasured(col)) {
+      w = statWidth(col, t->measured);
+      int title = col->title ? (int)strlen(col->title) : 0;
+      w = w > title ? w : title;
+      w = w < col->min_width ? col->min_width : w;
+      w = w > col->max_width ? col->max_width : w;
+    }
+    col->width = w;
+    used += w;
+  }
+  for (int c = t->num_cols - 1; c >= 0 && used > avail; c--) {
+    TableColumn *col = &t->cols[c];
+    if (columnMeasured(col) && col->width > col->min_width) {
+      int give = col->width - col->min_width;
+      give = give < used - avail ? give : used - avail;
+      col->width -= give;
+      used -= give;
+    }
+  }
+  if (flex >= 0 && used < avail) {
+    t->cols[flex].width += avail - used;
+  }
+  t->layout_dirty = 0;
+  t->layout_rows = t->measured;
+}
+
+/*** Table ***/
+
+void table_set_columns(Table *t, const TableColumn *cols, int num_cols,
+                       table_cell_fn cell, void *data) {
+  if (num_cols > TABLE_MAX_COLS) {
+    num_cols = TABLE_MAX_COLS;
+  }
+  memcpy(t->cols, cols, num_cols * sizeof(TableColumn));
+  t->num_cols = num_cols;
+  t->cell = cell;
+  t->data = data;
+  resetStats(t);
+  measureRows(t);
+}
+
+void table_set_rows(Table *t, size_t num_rows) {
+  if (num_rows < t->num_rows) {
+    resetStats(t);
+    t->selected = 0;
+    t->offset = 0;
+  }
+  t->num_rows = num_rows;
+  measureRows(t);
+  // The first screenful is too few rows for a percentile to mean much, so
+  // the layout follows the statistics while they settle: each time the rows
+  // measured double, up to TABLE_SETTLE_ROWS. A dozen layouts at most, then
+  // the columns stay put until a resize.
+  if (t->layout_rows < TABLE_SETTLE_ROWS &&
+      (t->measured >= 2 * t->layout_rows ||
+       t->layout_rows < (size_t)table_body_rows(t)) &&
+      t->measured > t->layout_rows) {
+    t->layout_dirty = 1;
+  }
+  if (t->selected >= num_rows) {
+    t->selected = num_rows > 0 ? num_rows - 1 : 0;
+  }
+}
+
+void table_resize(Table *t, int x, int y, int w, int h) {
+  t->x = x;
+  t->y = y;
+  t->w = w;
+  t->h = h;
+  t->layout_dirty = 1;
+}
+
+void table_move(Table *t, long long delta) {
+  if (t->num_rows == 0) {
+    return;
+  }
+  long long to = (long long)t->selected + delta;
+  if (to < 0) {
+    to = 0;
+  }
+  if (to >= (long long)t->num_rows) {
+    to = t->num_rows - 1;
+  }
+  t->selected = to;
+}
+
+void table_draw(Table *t) {
+  if (t->h <= 0 || t->w <= 0) {
+    return;
+  }
+  if (t->layout_dirty) {
+    tableLayout(t);
+  }
+  size_t body = table_body_rows(t);
+  if (t->selected < t->offset) {
+    t->offset = t->selected;
+  }
+  if (body > 0 && t->selected >= t->offset + body) {
+    t->offset = t->selected - body + 1;
+  }
+
+  tui_draw_rect(t->x, t->y, t->w, 1, t->header_bg);
+  int x = t->x;
+  for (int c = 0; c < t->num_cols; c++) {
+    const TableColumn *col = &t->cols[c];
+    if (col->title != NULL) {
+      drawClipped(x, t->y, col->width, col->title, strlen(col->title),
+                  t->header_fg, t->header_bg);
+    }
+    x += col->width + 1;
+  }
+
+  for (size_t r = 0; r < body; r++) {
+    int y = t->y + 1 + r;
+    size_t row = t->offset + r;
+    tui_color bg = row == t->selected ? t->selected_bg : t->bg;
+    tui_draw_rect(t->x, y, t->w, 1, row < t->num_rows ? bg : t->bg);
+    if (row >= t->num_rows) {
+      continue;
+    }
+    x = t->x;
+    for (int c = 0; c < t->num_cols; c++) {
+      TableCell cell = {NULL, 0, t->fg};
+      t->cell(t->data, row, c, &cell);
+      int width = t->cols[c].width;
+      if (x + width > t->x + t->w) {
+        width = t->x + t->w - x;
+      }
+      drawClipped(x, y, width, cell.text, cell.len, cell.fg, bg);
+      x += t->cols[c].width + 1;
+    }
+  }
+}
@@ -0,0 +1,110 @@
+#ifndef TABLE_H
+#define TABLE_H
+
+#include "tui.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*** Table Widget ***/
+
+#define TABLE_MAX_COLS 8
+// Widths from 0 to TABLE_HIST_WIDTHS - 1 get a histogram bucket each, wider
+// ones share the last.
+#define TABLE_HIST_WIDTHS 128
+
+/**
+ * A column as the schema describes it, plus what the table learned about it.
+ *
+ * Columns with min_width == max_width are fixed and never measured. The flex
+ * column takes whatever the others leave. The rest are sized from their
+ * contents: the width that percentile percent of rows fit in, clamped to
+ * min..max, so one long author name doesn't squeeze every subject.
+ */
+typedef struct TableColumn {
+  const char *title;
+  int min_width;
+  int max_width;
+  int flex;
+  int percentile; // 100 for the widest row
+
+  // Kept up to date as rows come in, one histogram bump per measured row.
+  uint32_t hist[TABLE_HIST_WIDTHS];
+  int widest;
+  int width; // from the last layout
+} TableColumn;
+
+// What the table draws at one row and column. text doesn't have to be NUL
+// terminated and only has to live until the table is done with the cell.
+typedef struct TableCell {
+  const char *text;
+  int len;
+  tui_color fg;
+} TableCell;
+
+typedef void (*table_cell_fn)(void *data, size_t row, int col,
+                              TableCell *cell);
+
+/**
+ * Only rows offset .. offset + body height ever get asked for, and rows get
+ * measured once, when they are added. Scrolling, drawing and streaming in
+ * more rows cost the same at 10 rows as at 10M.
+ */
+typedef struct Table {
+  TableColumn cols[TABLE_MAX_COLS];
+  int num_cols;
+  table_cell_fn cell;
+  void *data;
+
+  size_t num_rows;
+  size_t measured; // rows the column statistics have seen
+  size_t selected;
+  size_t offset; // first row on screen
+
+  int x, y, w, h; // screen area, the header takes its first row
+  // Set by a resize or a new schema, and a few more times while the first
+  // few thousand rows come in and the statistics are still settling.
+  int layout_dirty;
+  size_t layout_rows;
+
+  tui_color fg;
+  tui_color bg;
+  tui_color selected_bg;
+  tui_color header_fg;
+  tui_color header_bg;
+} Table;
+
+/**
+ * table_set_columns: Sets the schema, which starts the statistics over and
+ * lays the table out again on the next draw. Rows stay.
+ */
+void table_set_columns(Table *t, const TableColumn *cols, int num_cols,
+                       table_cell_fn cell, void *data);
+
+/**
+ * table_set_rows: Tells the table how many rows there are now. Rows past the
+ * old count get measured, fewer rows than before (a new query) start the
+ * statistics over.
+ */
+void table_set_rows(Table *t, size_t num_rows);
+
+// Places the table on screen, the layout is redone on the next draw.
+void table_resize(Table *t, int x, int y, int w, int h);
+
+// Moves the selection by delta rows, clamped to the table.
+void table_move(Table *t, long long delta);
+
+static inline size_t table_selected(const Table *t) { return t->selected; }
+
+// Rows of the table body, the page size for table_move().
+static inline int table_body_rows(const Table *t) {
+  return t->h > 1 ? t->h - 1 : 0;
+}
+
+/**
+ * table_draw: Scrolls the selection into view and draws the header and the
+ * visible rows into the Next buffer.
+ */
+void table_draw(Table *t);
+
+#endif